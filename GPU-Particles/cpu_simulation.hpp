@@ -0,0 +1,388 @@
+#ifndef _CPU_SIMULATION_
+#define _CPU_SIMULATION_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "sdf.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
+
+/**
+ * A fixed set of threads which split ranges of work between them.
+ */
+class WorkerPool
+{
+public:
+	static const size_t kChunkSize = 16384;
+
+	~WorkerPool() {
+		stop();
+	}
+
+	void start(int count) {
+		stopping = false;
+		busy.reset(new std::atomic<long long>[count]);
+		for (int i = 0; i < count; ++i) {
+			busy[i] = 0;
+			threads.emplace_back(&WorkerPool::work, this, i);
+		}
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start_job.notify_all();
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		threads.clear();
+	}
+
+	/**
+	 * Calls |f(begin, end)| over chunks of [0, count) on every worker,
+	 * returning once all of them are done.
+	 */
+	void run(size_t count, const std::function<void(size_t, size_t)> &f) {
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &f;
+		job_count = count;
+		next_chunk = 0;
+		remaining = (int)threads.size();
+		++generation;
+		start_job.notify_all();
+		job_done.wait(lock, [this] { return remaining == 0; });
+		job = NULL;
+	}
+
+	int getWorkerCount() const {
+		return (int)threads.size();
+	}
+
+	/**
+	 * Nanoseconds |worker| has spent working since it started.
+	 */
+	long long getBusyNanoseconds(int worker) const {
+		return busy[worker].load(std::memory_order_relaxed);
+	}
+
+private:
+	void work(int worker) {
+		int seen = 0;
+		while (true) {
+			const std::function<void(size_t, size_t)> *f = NULL;
+			size_t count = 0;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start_job.wait(lock, [this, seen] { return stopping || generation != seen; });
+				if (stopping) {
+					return;
+				}
+				seen = generation;
+				f = job;
+				count = job_count;
+			}
+
+			std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+			for (size_t chunk = next_chunk++; chunk * kChunkSize < count; chunk = next_chunk++) {
+				(*f)(chunk * kChunkSize, std::min(count, (chunk + 1) * kChunkSize));
+			}
+			busy[worker] += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::high_resolution_clock::now() - begin).count();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--remaining == 0) {
+				job_done.notify_one();
+			}
+		}
+	}
+
+	std::vector<std::thread> threads;
+	std::unique_ptr<std::atomic<long long>[]> busy;
+
+	std::mutex mutex;
+	std::condition_variable start_job;
+	std::condition_variable job_done;
+	bool stopping = false;
+
+	const std::function<void(size_t, size_t)> *job = NULL;
+	size_t job_count = 0;
+	std::atomic<size_t> next_chunk;
+	int remaining = 0;
+	int generation = 0;
+};
+
+/**
+ * Everything the simulation needs from the input thread, sent whole
+ * whenever the input thread runs.
+ */
+struct SimulationInput
+{
+	float mouse_position[2] = { 0.0f, 0.0f };
+	bool mouse_down = false;
+	bool paused = false;
+
+	float decay = 0.0f;
+	float lift = 0.0f;
+	float drag = 1.0f;
+};
+
+/**
+ * A completed simulation step, as uploaded to the position texture.
+ */
+struct SimulationFrame
+{
+	std::vector<float> positions;
+	int step = 0;
+};
+
+/**
+ * Steps the particles on the CPU, mirroring update.frag without curl
+ * noise, on its own thread and worker pool. Completed steps are
+ * published through a triple buffer so the render thread always takes
+ * the newest one without waiting, and input arrives through a
+ * single producer queue.
+ */
+class CpuSimulation
+{
+public:
+	static const int kInputQueueSize = 64;
+
+	~CpuSimulation() {
+		stop();
+	}
+
+	bool isRunning() const {
+		return running;
+	}
+
+	/**
+	 * Starts simulating |count| particles from their RGBA |positions|.
+	 * |colliders| must outlive the simulation.
+	 */
+	void start(const float *positions, size_t count, int steps_per_second,
+		const std::vector<SignedDistanceField> *simulation_colliders,
+		float radius, float restitution, float friction) {
+		particle_count = count;
+		step_period = std::chrono::nanoseconds(1000000000ll / steps_per_second);
+		colliders = simulation_colliders;
+		collider_radius = radius;
+		collider_restitution = restitution;
+		collider_friction = friction;
+
+		state_positions.assign(positions, positions + count * 4);
+		velocities.assign(count * 3, 0.0f);
+		for (int i = 0; i < 3; ++i) {
+			frames.getBuffers()[i].positions = state_positions;
+		}
+
+		int workers = std::max(1, (int)std::thread::hardware_concurrency() - 2);
+		pool.start(workers);
+
+		stopping = false;
+		simulation_busy = 0;
+		steps = 0;
+		last_report = std::chrono::high_resolution_clock::now();
+		last_busy.assign(workers + 1, 0);
+		last_steps = 0;
+
+		thread = std::thread(&CpuSimulation::run, this);
+		running = true;
+	}
+
+	void stop() {
+		if (!running) {
+			return;
+		}
+		stopping = true;
+		thread.join();
+		pool.stop();
+		running = false;
+	}
+
+	/**
+	 * Only ever called from the input thread.
+	 */
+	bool pushInput(const SimulationInput &input) {
+		return inputs.push(input);
+	}
+
+	/**
+	 * The newest completed step, or NULL if there is none since the
+	 * last call. Only ever called from the render thread.
+	 */
+	const SimulationFrame *acquireFrame() {
+		return frames.acquire() ? frames.getFrontBuffer() : NULL;
+	}
+
+	/**
+	 * Prints how busy the simulation thread, its workers and the render
+	 * thread have been since the last report.
+	 */
+	void reportUtilization(double render_busy_seconds) {
+		std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+		double elapsed = std::chrono::duration<double>(now - last_report).count();
+		last_report = now;
+		if (elapsed <= 0.0) {
+			return;
+		}
+
+		long long simulation = simulation_busy.load(std::memory_order_relaxed);
+		int step = steps.load(std::memory_order_relaxed);
+		std::cout << "Utilization: render " << (int)(100.0 * render_busy_seconds / elapsed)
+			<< "%, simulation " << (int)(100.0 * (simulation - last_busy[0]) / 1e9 / elapsed)
+			<< "% (" << (int)((step - last_steps) / elapsed) << " steps/s), workers";
+		last_busy[0] = simulation;
+		last_steps = step;
+		for (int i = 0; i < pool.getWorkerCount(); ++i) {
+			long long busy = pool.getBusyNanoseconds(i);
+			std::cout << " " << (int)(100.0 * (busy - last_busy[i + 1]) / 1e9 / elapsed) << "%";
+			last_busy[i + 1] = busy;
+		}
+		std::cout << std::endl;
+	}
+
+private:
+	/**
+	 * The rand() of update.frag.
+	 */
+	static float shaderRand(float x, float y) {
+		float r = sin(x * 12.9898f + y * 78.233f) * 43758.5453f;
+		return r - floor(r);
+	}
+
+	void run() {
+		SimulationInput input;
+		bool has_input = false;
+		std::chrono::high_resolution_clock::time_point next_step = std::chrono::high_resolution_clock::now();
+
+		while (!stopping) {
+			SimulationInput next;
+			while (inputs.pop(next)) {
+				input = next;
+				has_input = true;
+			}
+			if (!has_input || input.paused) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				next_step = std::chrono::high_resolution_clock::now();
+				continue;
+			}
+
+			std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+
+			SimulationFrame *frame = frames.getBackBuffer();
+			float *output = frame->positions.data();
+			pool.run(particle_count, [&](size_t first, size_t last) {
+				step(first, last, input, output);
+			});
+			frame->step = ++step_index;
+			frames.publish();
+			++steps;
+
+			std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+			simulation_busy += std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+
+			// Hold a fixed step rate, steps are not scaled by elapsed time.
+			next_step += step_period;
+			if (next_step > end) {
+				std::this_thread::sleep_until(next_step);
+			} else {
+				next_step = end;
+			}
+		}
+	}
+
+	void step(size_t first, size_t last, const SimulationInput &input, float *output) {
+		static const float kPi = 3.1415926535897932384626433832795f;
+		Point3 mouse(input.mouse_position[0], input.mouse_position[1], 0.0f);
+
+		for (size_t i = first; i < last; ++i) {
+			float *p = &state_positions[i * 4];
+			float *v = &velocities[i * 3];
+			Point3 position(p[0], p[1], p[2]);
+			Point3 velocity(v[0], v[1], v[2]);
+			float life = p[3];
+
+			if (input.mouse_down) {
+				Point3 to_mouse = position - mouse;
+				float distance = sqrt(dot(to_mouse, to_mouse));
+				velocity = velocity - normalize(to_mouse) *
+					std::min(0.001f, 1.0f / (distance * distance * distance) / 1000.0f);
+			}
+
+			velocity.y += input.lift;
+			velocity = velocity * input.drag;
+
+			life -= input.decay;
+			// Reset if 0 life
+			if (life < 0.0f) {
+				life = shaderRand(position.x, position.y);
+				position.x = mouse.x + shaderRand(position.x, position.y) / 50.0f;
+				position.y = mouse.y + shaderRand(position.y, position.z) / 50.0f;
+				position.z = 0.0f;
+
+				float theta = shaderRand(position.x, (float)step_index) * 2.0f * kPi;
+				float z = shaderRand(position.y, (float)step_index) * 2.0f - 1.0f;
+				float radius = 0.002f;
+				velocity.x = radius * sqrt(1.0f - z * z) * cos(theta);
+				velocity.y = radius * sqrt(1.0f - z * z) * sin(theta);
+				velocity.z = radius * z;
+			}
+
+			position = position + velocity;
+			for (const SignedDistanceField &collider : *colliders) {
+				collider.collide(position, velocity, collider_radius, collider_restitution, collider_friction);
+			}
+
+			p[0] = output[i * 4 + 0] = position.x;
+			p[1] = output[i * 4 + 1] = position.y;
+			p[2] = output[i * 4 + 2] = position.z;
+			p[3] = output[i * 4 + 3] = life;
+			v[0] = velocity.x;
+			v[1] = velocity.y;
+			v[2] = velocity.z;
+		}
+	}
+
+	bool running = false;
+
+	size_t particle_count = 0;
+	std::vector<float> state_positions;
+	std::vector<float> velocities;
+	int step_index = 0;
+
+	const std::vector<SignedDistanceField> *colliders = NULL;
+	float collider_radius = 0.0f;
+	float collider_restitution = 0.0f;
+	float collider_friction = 0.0f;
+
+	std::chrono::nanoseconds step_period;
+
+	std::thread thread;
+	std::atomic<bool> stopping;
+	WorkerPool pool;
+
+	SingleProducerQueue<SimulationInput, kInputQueueSize> inputs;
+	TripleBuffer<SimulationFrame> frames;
+
+	std::atomic<long long> simulation_busy;
+	std::atomic<int> steps;
+
+	// Only touched by reportUtilization().
+	std::chrono::high_resolution_clock::time_point last_report;
+	std::vector<long long> last_busy;
+	int last_steps = 0;
+};
+
+#endif
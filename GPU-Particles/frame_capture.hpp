@@ -0,0 +1,324 @@
+#ifndef _FRAME_CAPTURE_
+#define _FRAME_CAPTURE_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Utility\gl.hpp"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define POPEN_WRITE_MODE "wb"
+#else
+#define POPEN_WRITE_MODE "w"
+#endif
+
+/**
+ * Captures the back buffer every frame without stalling on the read.
+ *
+ * Frames are read into a ring of pixel buffer objects and only mapped
+ * once the ring comes back around to them, by which point the copy has
+ * completed. Mapped frames are handed to a writer thread through a
+ * bounded queue; when the writer falls behind, new frames are dropped
+ * rather than blocking the render loop.
+ *
+ * Output is Y4M (4:4:4) or raw RGB24. A path starting with '|' is run
+ * as a command and fed raw RGB24 on its stdin, e.g.
+ * "|ffmpeg -f rawvideo -pix_fmt rgb24 -s 1080x680 -r 60 -i - out.mp4".
+ */
+class FrameCapture
+{
+public:
+	static const int kPBOCount = 3;
+	static const int kQueueDepth = 8;
+
+	/**
+	 * The GL context may already be gone, so this only finishes writing
+	 * what has been retrieved. Call stop() while the context is current.
+	 */
+	~FrameCapture() {
+		if (capturing) {
+			finish();
+		}
+	}
+
+	bool isCapturing() const {
+		return capturing;
+	}
+
+	bool start(const std::string &path, int frame_width, int frame_height, int frame_rate = 60) {
+		if (capturing) {
+			return false;
+		}
+
+		piped = !path.empty() && path[0] == '|';
+		if (piped) {
+			output = popen(path.c_str() + 1, POPEN_WRITE_MODE);
+		} else {
+			output = fopen(path.c_str(), "wb");
+		}
+		if (output == NULL) {
+			std::cerr << "Failed to open capture output: " << path << std::endl;
+			return false;
+		}
+
+		width = frame_width;
+		height = frame_height;
+		y4m = !piped && path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+		if (y4m) {
+			fprintf(output, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", width, height, frame_rate);
+		}
+
+		size_t frame_bytes = width * height * 3;
+		glGenBuffers(kPBOCount, pbos);
+		for (int i = 0; i < kPBOCount; ++i) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, frame_bytes, 0, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		for (int i = 0; i < kQueueDepth; ++i) {
+			free_frames.push_back(new std::vector<unsigned char>(frame_bytes));
+		}
+
+		next_pbo = 0;
+		pending_pbos = 0;
+		captured_frames = 0;
+		dropped_frames = 0;
+		capture_seconds = 0.0;
+		frame_seconds = 0.0;
+		last_capture = std::chrono::high_resolution_clock::now();
+
+		stopping = false;
+		writer = std::thread(&FrameCapture::writeFrames, this);
+
+		capturing = true;
+		return true;
+	}
+
+	/**
+	 * Queues a read of the currently bound read framebuffer. Must be
+	 * called before the buffers are swapped.
+	 */
+	void capture() {
+		if (!capturing) {
+			return;
+		}
+
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		frame_seconds += std::chrono::duration<double>(begin - last_capture).count();
+		last_capture = begin;
+
+		// The ring is full, the oldest read has had kPBOCount - 1 frames to finish.
+		if (pending_pbos == kPBOCount) {
+			retrieve(pbos[next_pbo]);
+			--pending_pbos;
+		}
+
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next_pbo]);
+		glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		next_pbo = (next_pbo + 1) % kPBOCount;
+		++pending_pbos;
+
+		capture_seconds += std::chrono::duration<double>(
+			std::chrono::high_resolution_clock::now() - begin).count();
+	}
+
+	void stop() {
+		if (!capturing) {
+			return;
+		}
+
+		// Drain the reads still in flight, oldest first.
+		int pbo = (next_pbo + kPBOCount - pending_pbos) % kPBOCount;
+		for (; pending_pbos > 0; --pending_pbos) {
+			retrieve(pbos[pbo]);
+			pbo = (pbo + 1) % kPBOCount;
+		}
+		glDeleteBuffers(kPBOCount, pbos);
+
+		finish();
+	}
+
+private:
+	/**
+	 * Lets the writer drain its queue, then closes the output.
+	 */
+	void finish() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		ready.notify_one();
+		writer.join();
+
+		if (piped) {
+			pclose(output);
+		} else {
+			fclose(output);
+		}
+		output = NULL;
+
+		for (std::vector<unsigned char> *frame : free_frames) {
+			delete frame;
+		}
+		free_frames.clear();
+
+		capturing = false;
+
+		int frames = captured_frames + dropped_frames;
+		if (frames > 0) {
+			double capture_ms = 1000.0 * capture_seconds / frames;
+			double frame_ms = 1000.0 * frame_seconds / frames;
+			std::cout << "Captured " << captured_frames << " frames, dropped " << dropped_frames
+				<< ", capture cost " << capture_ms << " ms of " << frame_ms << " ms per frame ("
+				<< (frame_ms > 0.0 ? 100.0 * capture_ms / frame_ms : 0.0) << "%)" << std::endl;
+		}
+	}
+
+	/**
+	 * Maps |pbo| and hands its contents to the writer, dropping
+	 * the frame if the writer has no free frames left.
+	 */
+	void retrieve(GLuint pbo) {
+		std::vector<unsigned char> *frame = NULL;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!free_frames.empty()) {
+				frame = free_frames.back();
+				free_frames.pop_back();
+			}
+		}
+		if (frame == NULL) {
+			++dropped_frames;
+			return;
+		}
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+		const unsigned char *pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (pixels != NULL) {
+			memcpy(frame->data(), pixels, frame->size());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (pixels != NULL) {
+				queued_frames.push_back(frame);
+				++captured_frames;
+			} else {
+				free_frames.push_back(frame);
+				++dropped_frames;
+			}
+		}
+		ready.notify_one();
+	}
+
+	void writeFrames() {
+		std::vector<unsigned char> planes;
+		if (y4m) {
+			planes.resize(width * height * 3);
+		}
+
+		while (true) {
+			std::vector<unsigned char> *frame = NULL;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [this] { return stopping || !queued_frames.empty(); });
+				if (queued_frames.empty()) {
+					return;
+				}
+				frame = queued_frames.front();
+				queued_frames.pop_front();
+			}
+
+			if (y4m) {
+				writeY4M(*frame, planes);
+			} else {
+				writeRGB(*frame);
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			free_frames.push_back(frame);
+		}
+	}
+
+	void writeRGB(const std::vector<unsigned char> &frame) {
+		// GL rows run bottom to top.
+		size_t row_bytes = width * 3;
+		for (int y = height - 1; y >= 0; --y) {
+			fwrite(frame.data() + y * row_bytes, 1, row_bytes, output);
+		}
+	}
+
+	void writeY4M(const std::vector<unsigned char> &frame, std::vector<unsigned char> &planes) {
+		size_t plane_size = width * height;
+		unsigned char *y_plane = planes.data();
+		unsigned char *u_plane = y_plane + plane_size;
+		unsigned char *v_plane = u_plane + plane_size;
+
+		for (int y = 0; y < height; ++y) {
+			const unsigned char *row = frame.data() + (height - 1 - y) * width * 3;
+			for (int x = 0; x < width; ++x) {
+				// BT.601 full range.
+				float r = row[x * 3 + 0];
+				float g = row[x * 3 + 1];
+				float b = row[x * 3 + 2];
+				size_t i = y * width + x;
+				y_plane[i] = clampByte(0.299f * r + 0.587f * g + 0.114f * b);
+				u_plane[i] = clampByte(-0.169f * r - 0.331f * g + 0.5f * b + 128.0f);
+				v_plane[i] = clampByte(0.5f * r - 0.419f * g - 0.081f * b + 128.0f);
+			}
+		}
+
+		fputs("FRAME\n", output);
+		fwrite(planes.data(), 1, planes.size(), output);
+	}
+
+	static unsigned char clampByte(float value) {
+		return (unsigned char)(value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value + 0.5f));
+	}
+
+	bool capturing = false;
+	bool piped = false;
+	bool y4m = false;
+
+	int width = 0;
+	int height = 0;
+
+	FILE *output = NULL;
+
+	GLuint pbos[kPBOCount];
+	int next_pbo = 0;
+	int pending_pbos = 0;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable ready;
+	bool stopping = false;
+
+	std::deque<std::vector<unsigned char> *> queued_frames;
+	std::vector<std::vector<unsigned char> *> free_frames;
+
+	int captured_frames = 0;
+	int dropped_frames = 0;
+
+	double capture_seconds = 0.0;
+	double frame_seconds = 0.0;
+	std::chrono::high_resolution_clock::time_point last_capture;
+};
+
+#endif
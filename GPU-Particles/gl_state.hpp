@@ -0,0 +1,239 @@
+#ifndef _GL_STATE_
+#define _GL_STATE_
+
+#include <cstring>
+#include <map>
+
+#include "Utility\gl.hpp"
+
+/**
+ * A shadow copy of the GL binding state which skips calls that
+ * would not change anything. Calls made behind its back (including
+ * the Utility draw helpers) must be followed by an invalidate.
+ *
+ * Issued and skipped calls are counted across frames until resetStats().
+ * Only calls made through the cache are counted, not draws, clears,
+ * matrix stack calls or anything else issued directly.
+ */
+class GLState
+{
+public:
+	static const int kTextureUnits = 8;
+
+	GLState() {
+		invalidate();
+	}
+
+	void invalidate() {
+		program = kUnknown;
+		active_unit = kUnknown;
+		for (int i = 0; i < kTextureUnits; ++i) {
+			textures[i] = kUnknown;
+			targets[i] = GL_TEXTURE_2D;
+		}
+		framebuffer = kUnknown;
+		vertex_array = kUnknown;
+		viewport_rect[0] = viewport_rect[1] = viewport_rect[2] = viewport_rect[3] = -1;
+		point_size = -1.0f;
+		capabilities.clear();
+	}
+
+	void invalidateTexture(GLuint unit) {
+		textures[unit] = kUnknown;
+	}
+
+	void useProgram(GLuint new_program) {
+		if (!changed(program, new_program)) return;
+		glUseProgram(program);
+	}
+
+	void activeTexture(GLuint unit) {
+		if (!changed(active_unit, unit)) return;
+		glActiveTexture(GL_TEXTURE0 + active_unit);
+	}
+
+	void bindTexture(GLuint unit, GLuint texture, GLenum target = GL_TEXTURE_2D) {
+		if (targets[unit] != target) {
+			targets[unit] = target;
+			textures[unit] = kUnknown;
+		}
+		if (!changed(textures[unit], texture)) return;
+		activeTexture(unit);
+		glBindTexture(target, texture);
+	}
+
+	void bindFramebuffer(GLuint new_framebuffer) {
+		if (!changed(framebuffer, new_framebuffer)) return;
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	}
+
+	void bindVertexArray(GLuint new_vertex_array) {
+		if (!changed(vertex_array, new_vertex_array)) return;
+		glBindVertexArray(vertex_array);
+	}
+
+	void viewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+		if (viewport_rect[0] == x && viewport_rect[1] == y &&
+			viewport_rect[2] == width && viewport_rect[3] == height) {
+			++skipped_calls;
+			return;
+		}
+		viewport_rect[0] = x;
+		viewport_rect[1] = y;
+		viewport_rect[2] = width;
+		viewport_rect[3] = height;
+		++issued_calls;
+		glViewport(x, y, width, height);
+	}
+
+	void pointSize(GLfloat size) {
+		if (point_size == size) {
+			++skipped_calls;
+			return;
+		}
+		point_size = size;
+		++issued_calls;
+		glPointSize(size);
+	}
+
+	void setCapability(GLenum capability, bool enabled) {
+		std::map<GLenum, bool>::iterator it = capabilities.find(capability);
+		if (it != capabilities.end() && it->second == enabled) {
+			++skipped_calls;
+			return;
+		}
+		capabilities[capability] = enabled;
+		++issued_calls;
+		if (enabled) {
+			glEnable(capability);
+		} else {
+			glDisable(capability);
+		}
+	}
+
+	void enable(GLenum capability) {
+		setCapability(capability, true);
+	}
+
+	void disable(GLenum capability) {
+		setCapability(capability, false);
+	}
+
+	/**
+	 * Records a call which went through some other cache,
+	 * such as a UniformBlock upload.
+	 */
+	void countCall(bool issued) {
+		if (issued) {
+			++issued_calls;
+		} else {
+			++skipped_calls;
+		}
+	}
+
+	void beginFrame() {
+		++frames;
+	}
+
+	void resetStats() {
+		issued_calls = 0;
+		skipped_calls = 0;
+		frames = 0;
+	}
+
+	int getFrames() const {
+		return frames;
+	}
+
+	int getIssuedCalls() const {
+		return issued_calls;
+	}
+
+	int getSkippedCalls() const {
+		return skipped_calls;
+	}
+
+private:
+	static const GLuint kUnknown = ~0u;
+
+	bool changed(GLuint &current, GLuint value) {
+		if (current == value) {
+			++skipped_calls;
+			return false;
+		}
+		current = value;
+		++issued_calls;
+		return true;
+	}
+
+	GLuint program;
+	GLuint active_unit;
+	GLuint textures[kTextureUnits];
+	GLenum targets[kTextureUnits];
+	GLuint framebuffer;
+	GLuint vertex_array;
+	GLint viewport_rect[4];
+	GLfloat point_size;
+
+	std::map<GLenum, bool> capabilities;
+
+	int issued_calls = 0;
+	int skipped_calls = 0;
+	int frames = 0;
+};
+
+/**
+ * A std140 uniform block backed by a buffer object. The contents
+ * are only re-uploaded when they differ from the last upload.
+ */
+template <typename T>
+class UniformBlock
+{
+public:
+	void create(GLuint block_binding) {
+		binding = block_binding;
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(T), 0, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+		uploaded = false;
+	}
+
+	void destroy() {
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+
+	/**
+	 * Binds the block named |name| in |program| to this buffer.
+	 */
+	void attach(GLuint program, const char *name) {
+		GLuint index = glGetUniformBlockIndex(program, name);
+		if (index != GL_INVALID_INDEX) {
+			glUniformBlockBinding(program, index, binding);
+		}
+	}
+
+	void upload(const T &data, GLState &gl_state) {
+		if (uploaded && memcmp(&contents, &data, sizeof(T)) == 0) {
+			gl_state.countCall(false);
+			return;
+		}
+		contents = data;
+		uploaded = true;
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &contents);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		gl_state.countCall(true);
+	}
+
+private:
+	GLuint buffer = 0;
+	GLuint binding = 0;
+
+	T contents;
+	bool uploaded = false;
+};
+
+#endif
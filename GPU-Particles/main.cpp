@@ -21,12 +21,16 @@
 *    distribution.
 */
 
+#include <cfloat>
+#include <chrono>
 #include <ctime>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <GL\glew.h>
 #include <GL\freeglut.h>
 #include <iostream>
+#include <map>
 #include <math.h>
 
 #include "Utility\algebra.hpp"
@@ -34,7 +38,14 @@
 #include "Utility\gl.hpp"
 #include "Utility\quaternion.hpp"
 
+#include "cpu_simulation.hpp"
 #include "flip_buffer.hpp"
+#include "frame_capture.hpp"
+#include "gl_state.hpp"
+#include "morton_sort.hpp"
+#include "quality_governor.hpp"
+#include "sdf.hpp"
+#include "step_controller.hpp"
 
 using namespace std;
 
@@ -44,16 +55,8 @@ struct UpdateShader : public Shader
 	Uniform velocity_uniform = -1;
 	Uniform normal_uniform = -1;
 
-	Uniform curl_noise_uniform = -1;
-
-	Uniform mouse_position_uniform = -1;
-	Uniform mouse_down_uniform = -1;
-
-	Uniform time_uniform = -1;
-
-	Uniform particle_decay_uniform = -1;
-	Uniform particle_lift_uniform = -1;
-	Uniform particle_drag_uniform = -1;
+	Uniform collider_bricks_uniform = -1;
+	Uniform collider_atlas_uniform = -1;
 };
 
 struct RenderShader : public Shader
@@ -62,21 +65,83 @@ struct RenderShader : public Shader
 	Uniform velocity_uniform = -1;
 	Uniform normal_uniform = -1;
 	Uniform shadow_map_uniform = -1;
+};
+
+struct DepthShader : public Shader
+{
+	Uniform position_uniform = -1;
+	Uniform velocity_uniform = -1;
+};
 
-	Uniform light_uniform = -1;
+// Binding points of the per-frame uniform blocks.
+enum UniformBinding
+{
+	SIMULATION_BINDING = 0,
+	LIGHT_BINDING = 1,
+	COLLIDER_BINDING = 2,
+};
 
-	Uniform life_fade = -1;
+// Must match the array sizes of ColliderBlock in update.frag.
+const int kMaxColliders = 4;
 
-	Uniform global_ambient = -1;
+/**
+ * Per-frame simulation parameters, laid out to match the std140
+ * SimulationBlock in update.frag.
+ */
+struct SimulationBlock
+{
+	GLfloat mouse_position[2];
+	GLfloat mouse_down;
+	GLfloat time;
+	GLfloat curl_noise;
+	GLfloat lift;
+	GLfloat drag;
+	GLfloat decay;
+	GLfloat noise_rate;
+	GLfloat dt;
+	GLfloat integrator;
+	GLfloat noise_phase;
+	GLfloat noise_steps;
+	GLfloat padding[3];
+};
 
-	Uniform light_mvp_uniform = -1;
-	Uniform light_bias_uniform = -1;
+/**
+ * Per-frame lighting parameters, laid out to match the std140
+ * LightBlock in render.vert and render.frag.
+ */
+struct LightBlock
+{
+	GLfloat light[16];
+	GLfloat light_mvp[16];
+	GLfloat light_bias[16];
+	GLfloat global_ambient[4];
+	GLfloat life_fade;
+	GLfloat shadows;
+	GLfloat padding[2];
 };
 
-struct DepthShader : public Shader
+struct SortShader : public Shader
 {
 	Uniform position_uniform = -1;
 	Uniform velocity_uniform = -1;
+	Uniform normal_uniform = -1;
+	Uniform permutation_uniform = -1;
+};
+
+/**
+ * Where each collider's signed distance field lives in the collider
+ * textures, laid out to match the std140 ColliderBlock in update.frag.
+ */
+struct ColliderBlock
+{
+	GLfloat origin[kMaxColliders][4]; // xyz origin, w cell size
+	GLfloat grid[kMaxColliders][4]; // xyz bricks, w first slice in the brick texture
+	GLfloat bricks_size[4];
+	GLfloat atlas_size[4];
+	GLfloat count;
+	GLfloat radius;
+	GLfloat restitution;
+	GLfloat friction;
 };
 
 struct InputState
@@ -108,9 +173,20 @@ struct Light
 	Matrix4x4 perpective;
 };
 
+// Where a sort started by beginSort() is, see advanceSort().
+enum SortStage
+{
+	SORT_IDLE = 0,
+	SORT_READING,
+	SORT_SORTING,
+};
+
 struct SimulationState
 {
-	int time = 0;
+	// Reference steps simulated so far, sent to update.frag as its time.
+	double simulated_time = 0.0;
+	// Frames simulated so far, paused frames are not counted.
+	int frame_count = 0;
 
 	size_t particle_count = 2000 * 2000;
 
@@ -118,6 +194,13 @@ struct SimulationState
 	float particle_lift = 0.0000;
 	float particle_drag = 0.99;
 
+	// Reference steps simulated each frame, split into update passes by the step controller.
+	float time_scale = 1.0f;
+	StepController step_controller;
+	MaxReduction error_reduction;
+	bool step_stats = false;
+	std::chrono::high_resolution_clock::time_point last_step_report;
+
 	float rotation_y = 0.0f;
 	float translation_z = -2.0f;
 
@@ -125,6 +208,21 @@ struct SimulationState
 	bool paused = false;
 	bool life_fade = true;
 	bool shadow_map = true;
+	bool gl_stats = false;
+	std::chrono::high_resolution_clock::time_point last_gl_stats_report;
+
+	// Side of the allocated shadow map.
+	int shadow_resolution = 512;
+
+	// Particles are reordered by Morton code every this many frames, 0 disables.
+	int sort_interval = 0;
+	int last_sort = 0;
+	bool sort_requested = false;
+	SortStage sort_stage = SORT_IDLE;
+	MortonSorter morton_sorter;
+	double sort_render_milliseconds = 0.0;
+
+	std::string capture_path = "capture.y4m";
 
 	std::vector<Light> lights;
 
@@ -138,12 +236,44 @@ struct SimulationState
 	RenderShader render_shader;
 	Shader noise_shader;
 	DepthShader depth_shader;
+	SortShader sort_shader;
 
 	FlipBuffer position_texture;
 	FlipBuffer velocity_texture;
 	FlipBuffer normal_texture;
 
 	FlipBuffer frame_buffer;
+
+	GLState gl_state;
+
+	UniformBlock<SimulationBlock> simulation_block;
+	UniformBlock<LightBlock> light_block;
+
+	std::vector<std::string> collider_paths;
+	int collider_resolution = 128;
+	float collider_radius = 0.005f;
+	float collider_restitution = 0.5f;
+	float collider_friction = 0.1f;
+
+	std::vector<SignedDistanceField> colliders;
+	UniformBlock<ColliderBlock> collider_block;
+	ColliderBlock collider_parameters;
+
+	// Simulate on the CPU on a thread of its own instead of in update.frag.
+	bool cpu_backend = false;
+	int cpu_steps_per_second = 60;
+	CpuSimulation cpu_simulation;
+	double render_busy_seconds = 0.0;
+	double swap_seconds = 0.0;
+	std::chrono::high_resolution_clock::time_point last_utilization_report;
+
+	FrameCapture frame_capture;
+
+	StageTimer stage_timer;
+	QualityGovernor governor;
+	std::chrono::high_resolution_clock::time_point last_tick;
+
+	SortBenchmark sort_benchmark;
 };
 
 SimulationState state;
@@ -155,12 +285,119 @@ size_t kTexHeight = kTexWidth;
 Texture kTextureColor = 0;
 Texture kTextureCurlNoise = 0;
 Texture kDepthTexture = 0;
+Texture kPermutationTexture = 0;
+Texture kColliderBrickTexture = 0;
+Texture kColliderAtlasTexture = 0;
 
 // Buffers
 GLuint kAttributeBuffer = 0;
+std::map<int, GLuint> kParticleVAOs; // By particle stride
 GLuint kColorFBO = 0;
 GLuint kNoiseFBO = 0;
 GLuint kDepthFBO = 0;
+GLuint kSortReadPBO = 0;
+GLuint kSortPermutationPBO = 0;
+GLuint kCpuUploadPBO = 0;
+
+/**
+ * Returns a vertex array over the particle indices which only visits
+ * every |stride|th particle, creating it on first use.
+ */
+GLuint getParticleVAO(int stride) {
+	std::map<int, GLuint>::iterator it = kParticleVAOs.find(stride);
+	if (it != kParticleVAOs.end()) {
+		return it->second;
+	}
+
+	GLuint vao = 0;
+	glGenVertexArrays(1, &vao);
+	state.gl_state.bindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, kAttributeBuffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 2 * stride, (char *)0);
+	//glEnableVertexAttribArray(1);
+	//glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (char *)2);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	GL_CHECK();
+
+	kParticleVAOs[stride] = vao;
+	return vao;
+}
+
+void flipParticleBuffers() {
+	state.position_texture.flip();
+	state.velocity_texture.flip();
+	state.normal_texture.flip();
+	state.frame_buffer.flip();
+}
+
+/**
+ * Advances the particles by |dt| reference steps, from the active
+ * buffers into the inactive ones.
+ */
+void updatePass(float dt) {
+	GLState &gl_state = state.gl_state;
+
+	// The draw buffers are part of the framebuffer state, set once in generateParticles().
+	gl_state.bindFramebuffer(*state.frame_buffer.getInactiveBuffer());
+	gl_state.viewport(0, 0, kTexWidth, kTexHeight);
+
+	// GL_TEXTURE_2D is per unit, only unit 0 is ever enabled.
+	gl_state.activeTexture(0);
+	gl_state.enable(GL_TEXTURE_2D);
+	gl_state.disable(GL_BLEND);
+	GL_CHECK();
+
+	gl_state.bindTexture(1, *state.position_texture.getActiveBuffer());
+	gl_state.bindTexture(2, *state.velocity_texture.getActiveBuffer());
+	gl_state.bindTexture(3, *state.normal_texture.getActiveBuffer());
+	gl_state.bindTexture(4, kTextureCurlNoise);
+	if (!state.colliders.empty()) {
+		gl_state.bindTexture(6, kColliderBrickTexture, GL_TEXTURE_3D);
+		gl_state.bindTexture(7, kColliderAtlasTexture, GL_TEXTURE_3D);
+	}
+	GL_CHECK();
+
+	gl_state.useProgram(state.update_shader.program);
+	GL_CHECK();
+
+	SimulationBlock block;
+	block.mouse_position[0] = state.input_state.mouse_position.x;
+	block.mouse_position[1] = state.input_state.mouse_position.y;
+	block.mouse_down = state.input_state.left_mouse_down;
+	block.time = (GLfloat)state.simulated_time;
+	block.curl_noise = state.curl_noise;
+	block.decay = state.particle_decay;
+	block.lift = state.particle_lift;
+	block.drag = state.particle_drag;
+	block.noise_rate = state.governor.getSettings().noise_rate;
+	block.dt = dt;
+	block.integrator = state.step_controller.getIntegrator();
+
+	// The whole steps k with time <= k < time + dt are due for curl noise.
+	// Snapping to whole steps keeps float step sizes like 1/3 from drifting
+	// past one and counting it twice or not at all.
+	double begin = state.simulated_time;
+	double end = begin + dt;
+	double whole = floor(end + 0.5);
+	if (fabs(end - whole) < 1e-6) {
+		end = whole;
+	}
+	double first_due = ceil(begin);
+	block.noise_phase = (GLfloat)fmod(first_due, (double)state.governor.getSettings().noise_rate);
+	block.noise_steps = (GLfloat)(ceil(end) - first_due);
+	block.padding[0] = block.padding[1] = block.padding[2] = 0.0f;
+	state.simulation_block.upload(block, gl_state);
+	state.simulated_time = end;
+	state.collider_block.upload(state.collider_parameters, gl_state);
+	GL_CHECK();
+
+	// glDrawTexturedQuad() binds its texture to the active unit, keep it off the samplers.
+	gl_state.activeTexture(0);
+	glDrawTexturedQuad(*state.position_texture.getActiveBuffer());
+	gl_state.invalidateTexture(0);
+	GL_CHECK();
+}
 
 void update() {
 	if (state.input_state.rotate_left)
@@ -175,91 +412,67 @@ void update() {
 
 	//state.lights[0].rotation *= Quaternion(0.005, 0, 0, 1);
 
-	if (state.paused) {
+	if (state.paused || state.cpu_backend) {
 		return;
 	}
 
-	GL_CHECK();
-
-	glBindFramebuffer(GL_FRAMEBUFFER, *state.frame_buffer.getInactiveBuffer());
-	GLenum buffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
-	glDrawBuffers(3, (GLenum*)buffers);
-
-	glViewport(0, 0, kTexWidth, kTexHeight);
-	
-	glEnable(GL_TEXTURE_2D);
-	glDisable(GL_BLEND);
-	GL_CHECK();
-
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, *state.position_texture.getActiveBuffer());
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, *state.velocity_texture.getActiveBuffer());
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, *state.normal_texture.getActiveBuffer());
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, kTextureCurlNoise);
-	GL_CHECK();
-
-	glUseShader(state.update_shader);
-	GL_CHECK();
+	StepController &step_controller = state.step_controller;
+	bool adaptive = step_controller.getTolerance() > 0.0f;
 
-	GLfloat mouse_pos[2] = { state.input_state.mouse_position.x, state.input_state.mouse_position.y };
-	glUniform2fv(state.update_shader.mouse_position_uniform, 1, mouse_pos);
-	glUniform1f(state.update_shader.mouse_down_uniform, state.input_state.left_mouse_down);
-	glUniform1f(state.update_shader.time_uniform, state.time++);
-	glUniform1f(state.update_shader.curl_noise_uniform, state.curl_noise);
-	glUniform1f(state.update_shader.particle_decay_uniform, state.particle_decay);
-	glUniform1f(state.update_shader.particle_lift_uniform, state.particle_lift);
-	glUniform1f(state.update_shader.particle_drag_uniform, state.particle_drag);
-	GL_CHECK();
+	float error = 0.0f;
+	float step = 0.0f;
+	if (adaptive && state.error_reduction.read(error, step)) {
+		step_controller.observe(error, step);
+	}
 
-	// TODO(orglofch): This rebinds the active texture
-	glDrawTexturedQuad(*state.position_texture.getActiveBuffer());
-	GL_CHECK();
+	float dt = 0.0f;
+	int passes = step_controller.plan(state.time_scale, dt);
+	if (passes == 0) {
+		// render() reads the inactive side, put the newest state there until tick() flips it back.
+		flipParticleBuffers();
+		return;
+	}
 
-	glUseProgram(0);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	state.stage_timer.begin(UPDATE_STAGE);
+	for (int i = 0; i < passes; ++i) {
+		// Every pass but the last is flipped in here, tick() flips the last after render().
+		if (i > 0) {
+			flipParticleBuffers();
+		}
+		updatePass(dt);
+	}
 
-	GL_CHECK();
+	// The velocity's w holds each particle's error estimate for the pass.
+	if (adaptive) {
+		static const GLfloat kErrorChannel[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+		state.error_reduction.reduce(state.gl_state, *state.velocity_texture.getInactiveBuffer(),
+			kTexWidth, kTexHeight, kErrorChannel, dt);
+	}
+	state.stage_timer.end();
 }
 
 void renderShadowMaps() {
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_ALPHA_TEST);
+	GLState &gl_state = state.gl_state;
 
-	glBindFramebuffer(GL_FRAMEBUFFER, kDepthFBO);
+	gl_state.disable(GL_BLEND);
+	gl_state.enable(GL_DEPTH_TEST);
+	gl_state.disable(GL_ALPHA_TEST);
 
-	// TODO(orglofch): Make the viewport the light resolution eventually
-	glViewport(0, 0, 512, 512);
+	gl_state.bindFramebuffer(kDepthFBO);
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, *state.position_texture.getInactiveBuffer());
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, *state.velocity_texture.getInactiveBuffer());
+	gl_state.viewport(0, 0, state.shadow_resolution, state.shadow_resolution);
 
-	glBindBuffer(GL_ARRAY_BUFFER, kAttributeBuffer);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 3, (char *)0);
-	//glEnableVertexAttribArray(1);
-	//glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (char *)2);
+	gl_state.bindTexture(1, *state.position_texture.getInactiveBuffer());
+	gl_state.bindTexture(2, *state.velocity_texture.getInactiveBuffer());
+
+	const QualitySettings &quality = state.governor.getSettings();
+	int stride = quality.particle_stride * quality.caster_stride;
+	gl_state.bindVertexArray(getParticleVAO(stride));
 	GL_CHECK();
 
-	glUseShader(state.depth_shader);
+	gl_state.useProgram(state.depth_shader.program);
 
-	Matrix4x4 lightMVPMat =
-		state.lights[0].perpective
-		* state.lights[0].rotation.unit().matrix()
-		* Matrix4x4::translation(state.lights[0].position);
+	state.stage_timer.begin(SHADOW_STAGE);
 
 	// TODO(orglofch): Make this work for multiple light sources.
 	for (Light &light : state.lights) {
@@ -273,62 +486,52 @@ void renderShadowMaps() {
 		glLoadIdentity();
 		glMultMatrixd((light.rotation.unit().matrix() * Matrix4x4::translation(light.position)).transpose().d);
 
-		glPointSize(3);
-		glDrawArrays(GL_POINTS, 0, state.particle_count);
+		gl_state.pointSize(3);
+		glDrawArrays(GL_POINTS, 0, state.particle_count / stride);
 	}
 
-	glUseProgram(0);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	state.stage_timer.end();
 }
 
 void render() {
-	if (state.shadow_map) {
+	GLState &gl_state = state.gl_state;
+
+	if (state.shadow_map && state.shadow_resolution > 0) {
 		renderShadowMaps();
 	}
 
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	gl_state.bindFramebuffer(0);
+	gl_state.disable(GL_BLEND);
+	gl_state.enable(GL_DEPTH_TEST);
 
-	glViewport(0, 0, state.window_state.window_size.x, state.window_state.window_size.y);
+	gl_state.viewport(0, 0, state.window_state.window_size.x, state.window_state.window_size.y);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 	glSetOrthographicProjection(0, state.window_state.window_size.x, 0, state.window_state.window_size.y, 0, 1);
-	glUseProgram(0);
-	glEnable(GL_TEXTURE_2D);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, kDepthTexture);
+	gl_state.useProgram(0);
+	gl_state.activeTexture(0);
+	gl_state.enable(GL_TEXTURE_2D);
+	gl_state.bindTexture(0, kDepthTexture);
 	glDrawRect(0, 200, 0, 200, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	gl_state.invalidateTexture(0);
 	GL_CHECK();
 
 	glSetPerspectiveProjection(80, state.window_state.window_size[0], state.window_state.window_size[1], 0.1, 10.0);
 	glTranslatef(0.0, 0.0, state.translation_z);
 	glRotatef(state.rotation_y, 0.0f, 1.0f, 0.0f);
 
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, *state.position_texture.getInactiveBuffer());
-	glActiveTexture(GL_TEXTURE2);
+	gl_state.bindTexture(1, *state.position_texture.getInactiveBuffer());
 	// Make this state.velocity_texture with GL_LINES for cool effects!
-	glBindTexture(GL_TEXTURE_2D, *state.velocity_texture.getInactiveBuffer());
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, *state.normal_texture.getInactiveBuffer());
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, kDepthTexture);
+	gl_state.bindTexture(2, *state.velocity_texture.getInactiveBuffer());
+	gl_state.bindTexture(3, *state.normal_texture.getInactiveBuffer());
+	gl_state.bindTexture(4, kDepthTexture);
 	GL_CHECK();
 
-	glBindBuffer(GL_ARRAY_BUFFER, kAttributeBuffer);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(GLfloat)* 3, (char *)0);
-	//glEnableVertexAttribArray(1);
-	//glVertexAttribPointer(1, 1, GL_FLOAT, GL_FALSE, 0, (char *)2);
+	int stride = state.governor.getSettings().particle_stride;
+	gl_state.bindVertexArray(getParticleVAO(stride));
 	GL_CHECK();
 
-	glUseShader(state.render_shader);
+	gl_state.useProgram(state.render_shader.program);
 
 	Vector3 realLightPosition = state.lights[0].rotation.unit().matrix() * state.lights[0].position;
 
@@ -344,57 +547,333 @@ void render() {
 		* state.lights[0].rotation.unit().matrix()
 		* Matrix4x4::translation(state.lights[0].position);
 
-	glUniform4fv(state.render_shader.light_uniform, 4, light);
-	glUniform4fv(state.render_shader.global_ambient, 1, state.global_ambient.d);
-	glUniform1f(state.render_shader.life_fade, state.life_fade);
-
-	Matrix4x4 transposeMVP = lightMVPMat.transpose();
-	GLfloat floatMVPMat[16];
-	for (int i = 0; i < 16; ++i) {
-		floatMVPMat[i] = transposeMVP.d[i];
-	}
-	glUniformMatrix4fv(state.render_shader.light_mvp_uniform, 1, GL_FALSE, floatMVPMat);
-
 	GLfloat biasMatrix[] = {
 		0.5, 0.0, 0.0, 0.0,
 		0.0, 0.5, 0.0, 0.0,
 		0.0, 0.0, 0.5, 0.0,
 		0.5, 0.5, 0.5, 1.0
 	};
-	glUniformMatrix4fv(state.render_shader.light_bias_uniform, 1, GL_FALSE, biasMatrix);
-
-	glPointSize(3);
-	glDrawArrays(GL_POINTS, 0, state.particle_count);
 
-	glUseProgram(0);
-	glActiveTexture(GL_TEXTURE1);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE2);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glActiveTexture(GL_TEXTURE3);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	LightBlock block;
+	memcpy(block.light, light, sizeof(light));
+	Matrix4x4 transposeMVP = lightMVPMat.transpose();
+	for (int i = 0; i < 16; ++i) {
+		block.light_mvp[i] = transposeMVP.d[i];
+	}
+	memcpy(block.light_bias, biasMatrix, sizeof(biasMatrix));
+	memcpy(block.global_ambient, state.global_ambient.d, sizeof(block.global_ambient));
+	block.life_fade = state.life_fade;
+	// The depth texture is left stale once shadows are off, skip the test instead.
+	block.shadows = state.shadow_map && state.shadow_resolution > 0;
+	block.padding[0] = block.padding[1] = 0.0f;
+	state.light_block.upload(block, gl_state);
+
+	state.stage_timer.begin(RENDER_STAGE);
+	gl_state.pointSize(3);
+	glDrawArrays(GL_POINTS, 0, state.particle_count / stride);
+	state.stage_timer.end();
+
+	// Leave the particle VAO unbound so that nothing else can modify it.
+	gl_state.bindVertexArray(0);
 
 	// TODO Render UI
 
+	state.frame_capture.capture();
+
+	// With vsync the swap mostly waits, keep it out of the render thread's utilization.
+	std::chrono::high_resolution_clock::time_point swap_begin = std::chrono::high_resolution_clock::now();
 	glutSwapBuffers();
+	state.swap_seconds = std::chrono::duration<double>(
+		std::chrono::high_resolution_clock::now() - swap_begin).count();
 	glutPostRedisplay();
 	GL_CHECK();
 }
 
+void resizeDepthBuffer(int resolution) {
+	state.shadow_resolution = resolution;
+	if (resolution == 0) {
+		return;
+	}
+
+	state.gl_state.activeTexture(0);
+	glBindTexture(GL_TEXTURE_2D, kDepthTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16,
+		resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+	state.gl_state.invalidateTexture(0);
+	GL_CHECK();
+}
+
+/**
+ * Unmaps the buffers a finished sort read from and wrote to,
+ * returning false if either mapping was lost.
+ */
+bool unmapSortBuffers() {
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, kSortReadPBO);
+	bool read = glUnmapBuffer(GL_PIXEL_PACK_BUFFER) == GL_TRUE;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, kSortPermutationPBO);
+	bool permutation = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	GL_CHECK();
+	return read && permutation;
+}
+
+/**
+ * Starts reordering the particle state textures into Morton order of the
+ * particle positions, so that particles near each other in space are also
+ * near each other in the textures. Particles keep their id in the normal's w.
+ *
+ * The positions are read back through a PBO and sorted on a thread of
+ * their own over the following frames, see advanceSort().
+ */
+void beginSort() {
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+
+	GLState &gl_state = state.gl_state;
+	size_t texel_count = kTexWidth * kTexHeight;
+
+	if (kSortReadPBO == 0) {
+		glGenBuffers(1, &kSortReadPBO);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, kSortReadPBO);
+		glBufferData(GL_PIXEL_PACK_BUFFER, texel_count * 4 * sizeof(GLfloat), 0, GL_STREAM_READ);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		glGenBuffers(1, &kSortPermutationPBO);
+
+		gl_state.activeTexture(0);
+		glGenTextures(1, &kPermutationTexture);
+		glBindTexture(GL_TEXTURE_2D, kPermutationTexture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, kTexWidth, kTexHeight, 0, GL_RG, GL_FLOAT, 0);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		gl_state.invalidateTexture(0);
+	}
+
+	gl_state.bindTexture(0, *state.position_texture.getActiveBuffer());
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, kSortReadPBO);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	GL_CHECK();
+
+	state.sort_stage = SORT_READING;
+	state.sort_render_milliseconds = std::chrono::duration<double, std::milli>(
+		std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+/**
+ * Moves a sort started by beginSort() along without waiting on it. The
+ * readback is mapped a frame after it was queued and handed to the sort
+ * thread, which writes the permutation straight into a mapped PBO. Once
+ * the thread is done the permutation is uploaded from the PBO and a
+ * gather pass writes position, velocity and normal into the inactive
+ * buffers, which are flipped in.
+ *
+ * Every texel gathers from exactly one texel, so the particles having
+ * moved during the sort only makes the order slightly stale.
+ */
+void advanceSort() {
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+
+	GLState &gl_state = state.gl_state;
+	size_t texel_count = kTexWidth * kTexHeight;
+
+	if (state.sort_stage == SORT_READING) {
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, kSortReadPBO);
+		const GLfloat *positions = (const GLfloat *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		// Orphan the previous permutation rather than wait for its upload.
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, kSortPermutationPBO);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, texel_count * 2 * sizeof(GLfloat), 0, GL_STREAM_DRAW);
+		GLfloat *permutation = (GLfloat *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		GL_CHECK();
+
+		if (positions == NULL || permutation == NULL) {
+			if (positions != NULL) {
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, kSortReadPBO);
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			}
+			if (permutation != NULL) {
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, kSortPermutationPBO);
+				glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+			state.sort_stage = SORT_IDLE;
+			return;
+		}
+
+		state.morton_sorter.start(positions, permutation, kTexWidth, kTexHeight);
+		state.sort_stage = SORT_SORTING;
+	} else if (state.sort_stage == SORT_SORTING && state.morton_sorter.isDone()) {
+		double sort_milliseconds = state.morton_sorter.finish();
+		state.sort_stage = SORT_IDLE;
+
+		// The permutation is undefined if the mapping was lost.
+		if (!unmapSortBuffers()) {
+			return;
+		}
+
+		gl_state.bindTexture(0, kPermutationTexture);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, kSortPermutationPBO);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTexWidth, kTexHeight, GL_RG, GL_FLOAT, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		GL_CHECK();
+
+		// Gather into the inactive buffers, then make them the active ones.
+		gl_state.bindFramebuffer(*state.frame_buffer.getInactiveBuffer());
+		gl_state.viewport(0, 0, kTexWidth, kTexHeight);
+		gl_state.disable(GL_BLEND);
+
+		gl_state.bindTexture(1, *state.position_texture.getActiveBuffer());
+		gl_state.bindTexture(2, *state.velocity_texture.getActiveBuffer());
+		gl_state.bindTexture(3, *state.normal_texture.getActiveBuffer());
+		gl_state.bindTexture(5, kPermutationTexture);
+
+		gl_state.useProgram(state.sort_shader.program);
+
+		gl_state.activeTexture(0);
+		glDrawTexturedQuad(*state.position_texture.getActiveBuffer());
+		gl_state.invalidateTexture(0);
+		GL_CHECK();
+
+		flipParticleBuffers();
+
+		state.sort_render_milliseconds += std::chrono::duration<double, std::milli>(
+			std::chrono::high_resolution_clock::now() - begin).count();
+		state.sort_benchmark.sorted(sort_milliseconds, state.sort_render_milliseconds);
+		return;
+	}
+
+	state.sort_render_milliseconds += std::chrono::duration<double, std::milli>(
+		std::chrono::high_resolution_clock::now() - begin).count();
+}
+
+/**
+ * Sends the input to the CPU simulation and uploads its newest
+ * completed step, if there is one, for render() to draw.
+ */
+void updateCpuSimulation() {
+	SimulationInput input;
+	input.mouse_position[0] = state.input_state.mouse_position.x;
+	input.mouse_position[1] = state.input_state.mouse_position.y;
+	input.mouse_down = state.input_state.left_mouse_down;
+	input.paused = state.paused;
+	input.decay = state.particle_decay;
+	input.lift = state.particle_lift;
+	input.drag = state.particle_drag;
+	// A full queue only means the simulation has older input to catch up on.
+	state.cpu_simulation.pushInput(input);
+
+	const SimulationFrame *frame = state.cpu_simulation.acquireFrame();
+	if (frame != NULL) {
+		// bindTexture() skips activeTexture() when unit 1 is already bound.
+		state.gl_state.bindTexture(1, *state.position_texture.getInactiveBuffer());
+		state.gl_state.activeTexture(1);
+
+		// Orphaning the PBO lets the copy in flight from the last frame carry
+		// on while this one is written, and glTexSubImage2D() returns at once.
+		size_t size = frame->positions.size() * sizeof(GLfloat);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, kCpuUploadPBO);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, 0, GL_STREAM_DRAW);
+		void *mapped = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+		if (mapped != NULL) {
+			memcpy(mapped, frame->positions.data(), size);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTexWidth, kTexHeight, GL_RGBA, GL_FLOAT, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		} else {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTexWidth, kTexHeight, GL_RGBA, GL_FLOAT, frame->positions.data());
+		}
+		GL_CHECK();
+	}
+}
+
+void startCpuSimulation() {
+	size_t texel_count = kTexWidth * kTexHeight;
+	std::vector<GLfloat> positions(texel_count * 4);
+	state.gl_state.bindTexture(1, *state.position_texture.getActiveBuffer());
+	state.gl_state.activeTexture(1);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, positions.data());
+
+	// Steps are only ever uploaded to the inactive side, render() reads it.
+	state.gl_state.bindTexture(1, *state.position_texture.getInactiveBuffer());
+	state.gl_state.activeTexture(1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, kTexWidth, kTexHeight, GL_RGBA, GL_FLOAT, positions.data());
+	GL_CHECK();
+
+	glGenBuffers(1, &kCpuUploadPBO);
+
+	state.cpu_simulation.start(positions.data(), texel_count, state.cpu_steps_per_second,
+		&state.colliders, state.collider_radius, state.collider_restitution, state.collider_friction);
+	state.last_utilization_report = std::chrono::high_resolution_clock::now();
+}
+
 void tick() {
 	GL_CHECK();
+	std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+	state.gl_state.beginFrame();
+	state.stage_timer.beginFrame();
+
+	if (state.cpu_backend) {
+		updateCpuSimulation();
+	} else if (!state.paused) {
+		++state.frame_count;
+		if (state.sort_stage != SORT_IDLE) {
+			advanceSort();
+		} else if (state.sort_requested ||
+			(state.sort_interval > 0 && state.frame_count - state.last_sort >= state.sort_interval)) {
+			beginSort();
+			state.sort_requested = false;
+			state.last_sort = state.frame_count;
+		}
+	}
+
 	update();
 	render();
 
-	if (!state.paused) {
-		state.position_texture.flip();
-		state.velocity_texture.flip();
-		state.normal_texture.flip();
-		state.frame_buffer.flip();
+	std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+	float frame_milliseconds = std::chrono::duration<float, std::milli>(now - state.last_tick).count();
+	state.last_tick = now;
+
+	state.governor.setNoiseEnabled(state.curl_noise);
+	if (state.governor.update(frame_milliseconds, state.stage_timer)) {
+		int resolution = state.governor.getSettings().shadow_resolution;
+		if (resolution != state.shadow_resolution) {
+			resizeDepthBuffer(resolution);
+		}
+	}
+
+	state.sort_benchmark.record(state.stage_timer.getMilliseconds(UPDATE_STAGE),
+		state.stage_timer.getMilliseconds(RENDER_STAGE));
+
+	if (state.gl_stats && now - state.last_gl_stats_report > std::chrono::seconds(1)) {
+		GLState &gl_state = state.gl_state;
+		int frames = std::max(1, gl_state.getFrames());
+		cout << "Cached GL state calls per frame: issued " << gl_state.getIssuedCalls() / frames
+			<< ", skipped " << gl_state.getSkippedCalls() / frames << endl;
+		gl_state.resetStats();
+		state.last_gl_stats_report = now;
+	}
+
+	if (state.cpu_backend) {
+		state.render_busy_seconds += std::chrono::duration<double>(
+			std::chrono::high_resolution_clock::now() - begin).count() - state.swap_seconds;
+		if (now - state.last_utilization_report > std::chrono::seconds(2)) {
+			state.cpu_simulation.reportUtilization(state.render_busy_seconds);
+			state.render_busy_seconds = 0.0;
+			state.last_utilization_report = now;
+		}
+	} else if (!state.paused) {
+		flipParticleBuffers();
+	}
+
+	if (state.step_stats && now - state.last_step_report > std::chrono::seconds(2)) {
+		state.step_controller.report(state.stage_timer.getMilliseconds(UPDATE_STAGE));
+		state.last_step_report = now;
 	}
 }
 
@@ -426,6 +905,27 @@ void handleMouseButton(int button, int button_state, int x, int y) {
 	}
 }
 
+void toggleCapture() {
+	if (state.frame_capture.isCapturing()) {
+		state.frame_capture.stop();
+	} else {
+		state.frame_capture.start(state.capture_path,
+			state.window_state.window_size[0], state.window_state.window_size[1]);
+	}
+}
+
+/**
+ * Called while the GL context is still current, unlike the static destructors.
+ */
+void handleClose() {
+	state.frame_capture.stop();
+	state.cpu_simulation.stop();
+	// The sort thread reads and writes mapped buffers.
+	if (state.morton_sorter.isRunning()) {
+		state.morton_sorter.finish();
+	}
+}
+
 void handlePressNormalKeys(unsigned char key, int x, int y) {
 	switch (key) {
 		case 'a':
@@ -444,9 +944,45 @@ void handlePressNormalKeys(unsigned char key, int x, int y) {
 		case 'S':
 			state.input_state.zoom_out = true;
 			break;
+		case 'g':
+		case 'G':
+			state.gl_stats = !state.gl_stats;
+			state.gl_state.resetStats();
+			state.last_gl_stats_report = std::chrono::high_resolution_clock::now();
+			break;
+		case 'c':
+		case 'C':
+			toggleCapture();
+			break;
+		case 'm':
+		case 'M':
+			// The CPU simulation keeps its particles in its own order.
+			if (state.cpu_backend) {
+				cout << "Morton sorting is not available with the CPU simulation" << endl;
+			} else {
+				state.sort_requested = true;
+			}
+			break;
+		case 'i':
+		case 'I':
+			state.step_controller.setIntegrator(
+				(Integrator)((state.step_controller.getIntegrator() + 1) % INTEGRATOR_COUNT));
+			cout << "Integrator " << getIntegratorName(state.step_controller.getIntegrator()) << endl;
+			break;
+		case 'b':
+		case 'B':
+			state.step_stats = !state.step_stats;
+			state.last_step_report = std::chrono::high_resolution_clock::now();
+			break;
+		case 'v':
+		case 'V':
+			state.governor.setEnabled(!state.governor.isEnabled());
+			cout << "Quality governor " << (state.governor.isEnabled() ? "enabled" : "disabled") << endl;
+			break;
 		case 'q':
 		case 'Q':
 		case 27: 
+			handleClose();
 			exit(EXIT_SUCCESS);
 	}
 }
@@ -502,19 +1038,16 @@ void init() {
 	state.update_shader.position_uniform = glGetUniform(state.update_shader, "positions");
 	state.update_shader.velocity_uniform = glGetUniform(state.update_shader, "velocities");
 	state.update_shader.normal_uniform = glGetUniform(state.update_shader, "normals");
-	state.update_shader.curl_noise_uniform = glGetUniform(state.update_shader, "curl_noise");
-	state.update_shader.mouse_position_uniform = glGetUniform(state.update_shader, "mouse_position");
-	state.update_shader.mouse_down_uniform = glGetUniform(state.update_shader, "mouse_down");
-	state.update_shader.time_uniform = glGetUniform(state.update_shader, "time");
-	state.update_shader.particle_decay_uniform = glGetUniform(state.update_shader, "decay");
-	state.update_shader.particle_lift_uniform = glGetUniform(state.update_shader, "lift");
-	state.update_shader.particle_drag_uniform = glGetUniform(state.update_shader, "drag");
+	state.update_shader.collider_bricks_uniform = glGetUniform(state.update_shader, "collider_bricks");
+	state.update_shader.collider_atlas_uniform = glGetUniform(state.update_shader, "collider_atlas");
 	GL_CHECK();
 
 	glUseShader(state.update_shader);
 	glUniform1i(state.update_shader.position_uniform, 1);
 	glUniform1i(state.update_shader.velocity_uniform, 2);
 	glUniform1i(state.update_shader.normal_uniform, 3);
+	glUniform1i(state.update_shader.collider_bricks_uniform, 6);
+	glUniform1i(state.update_shader.collider_atlas_uniform, 7);
 	GL_CHECK();
 
 	// Render shader.
@@ -523,12 +1056,7 @@ void init() {
 	state.render_shader.position_uniform = glGetUniform(state.render_shader, "positions");
 	state.render_shader.velocity_uniform = glGetUniform(state.render_shader, "velocities");
 	state.render_shader.normal_uniform = glGetUniform(state.render_shader, "normals");
-	state.render_shader.light_uniform = glGetUniform(state.render_shader, "light");
-	state.render_shader.life_fade = glGetUniform(state.render_shader, "life_fade");
-	state.render_shader.global_ambient = glGetUniform(state.render_shader, "global_ambient");
 	state.render_shader.shadow_map_uniform = glGetUniform(state.render_shader, "shadowMap");
-	state.render_shader.light_mvp_uniform = glGetUniform(state.render_shader, "lightMVP");
-	state.render_shader.light_bias_uniform = glGetUniform(state.render_shader, "lightBias");
 	GL_CHECK();
 
 	glUseProgram(state.render_shader.program);
@@ -554,6 +1082,34 @@ void init() {
 	glUniform1i(state.depth_shader.velocity_uniform, 2);
 	GL_CHECK();
 
+	// Sort shader.
+	state.sort_shader.program = glLoadShader("sort.vert", "sort.frag");
+
+	state.sort_shader.position_uniform = glGetUniform(state.sort_shader, "positions");
+	state.sort_shader.velocity_uniform = glGetUniform(state.sort_shader, "velocities");
+	state.sort_shader.normal_uniform = glGetUniform(state.sort_shader, "normals");
+	state.sort_shader.permutation_uniform = glGetUniform(state.sort_shader, "permutation");
+	GL_CHECK();
+
+	glUseProgram(state.sort_shader.program);
+	glUniform1i(state.sort_shader.position_uniform, 1);
+	glUniform1i(state.sort_shader.velocity_uniform, 2);
+	glUniform1i(state.sort_shader.normal_uniform, 3);
+	glUniform1i(state.sort_shader.permutation_uniform, 5);
+	GL_CHECK();
+
+	state.stage_timer.create();
+	state.error_reduction.create(kTexWidth, kTexHeight);
+
+	// Uniform blocks.
+	state.simulation_block.create(SIMULATION_BINDING);
+	state.simulation_block.attach(state.update_shader.program, "SimulationBlock");
+	state.light_block.create(LIGHT_BINDING);
+	state.light_block.attach(state.render_shader.program, "LightBlock");
+	state.collider_block.create(COLLIDER_BINDING);
+	state.collider_block.attach(state.update_shader.program, "ColliderBlock");
+	GL_CHECK();
+
 	glutDisplayFunc(tick);
 
 	glutIgnoreKeyRepeat(1);
@@ -565,6 +1121,7 @@ void init() {
 	glutSpecialFunc(handlePressSpecialKey);
 	glutSpecialUpFunc(handleReleaseSpecialKey);
 	glutReshapeFunc(handleResize);
+	glutCloseFunc(handleClose);
 
 	GL_CHECK();
 }
@@ -597,6 +1154,8 @@ void generateNoise() {
 	GL_CHECK();
 }
 
+const GLenum kParticleDrawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+
 void generateParticles() {
 	int texture_bytes = kTexWidth * kTexHeight * 4;
 	GLfloat *pData = new GLfloat[texture_bytes];
@@ -616,7 +1175,7 @@ void generateParticles() {
 		nData[i + 0] = pData[i + 0];
 		nData[i + 1] = pData[i + 1];
 		nData[i + 2] = pData[i + 2];
-		nData[i + 3] = 0.0f;
+		nData[i + 3] = (GLfloat)(i / 4); // Particle id
 	}
 	glCreateTexture2D(state.position_texture.getActiveBuffer(), kTexWidth, kTexHeight, 4, pData);
 	glCreateTexture2D(state.velocity_texture.getActiveBuffer(), kTexWidth, kTexHeight, 4, vData);
@@ -632,6 +1191,7 @@ void generateParticles() {
 		GL_TEXTURE_2D, *state.velocity_texture.getActiveBuffer(), 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2,
 		GL_TEXTURE_2D, *state.normal_texture.getActiveBuffer(), 0);
+	glDrawBuffers(3, (GLenum*)kParticleDrawBuffers);
 	GL_CHECK();
 
 	for (size_t i = 0; i < texture_bytes; ++i) {
@@ -650,6 +1210,7 @@ void generateParticles() {
 		GL_TEXTURE_2D, *state.velocity_texture.getInactiveBuffer(), 0);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2,
 		GL_TEXTURE_2D, *state.normal_texture.getInactiveBuffer(), 0);
+	glDrawBuffers(3, (GLenum*)kParticleDrawBuffers);
 	GL_CHECK();
 
 	delete[] pData;
@@ -695,16 +1256,10 @@ void generateColorBuffers() {
 }
 
 void generateDepthBuffer() {
-	// TODO(orglofch): Decrease this resolution
-	int buffer_bytes = 512 * 512;
-	GLfloat *depthData = new GLfloat[buffer_bytes];
-	for (size_t i = 0; i < buffer_bytes; ++i) {
-		depthData[i] = 0.0f;
-	}
 	glGenTextures(1, &kDepthTexture);
 	glBindTexture(GL_TEXTURE_2D, kDepthTexture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16,
-		512, 512, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+		state.shadow_resolution, state.shadow_resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -719,9 +1274,165 @@ void generateDepthBuffer() {
 	GL_CHECK();
 }
 
+/**
+ * Loads or bakes the signed distance field of every collider mesh and
+ * packs them into two 3D textures: one texel per brick saying where the
+ * brick's samples are, stacking the colliders along z, and an atlas of
+ * the samples of every allocated brick.
+ */
+void generateColliders() {
+	ColliderBlock &block = state.collider_parameters;
+	memset(&block, 0, sizeof(block));
+	block.radius = state.collider_radius;
+	block.restitution = state.collider_restitution;
+	block.friction = state.collider_friction;
+
+	for (const std::string &path : state.collider_paths) {
+		if ((int)state.colliders.size() == kMaxColliders) {
+			cerr << "Ignoring collider " << path << ", at most " << kMaxColliders << " are supported" << endl;
+			break;
+		}
+		SignedDistanceField field;
+		if (field.loadOrBake(path, state.collider_resolution)) {
+			state.colliders.push_back(field);
+		}
+	}
+	if (state.colliders.empty()) {
+		return;
+	}
+
+	// The normal's central differences reach half a cell past the particle, which
+	// only stays within the bricks allocated around the surface up to that radius.
+	float max_radius = FLT_MAX;
+	for (const SignedDistanceField &field : state.colliders) {
+		max_radius = min(max_radius, 0.5f * field.cell_size);
+	}
+	if (state.collider_radius > max_radius) {
+		cerr << "Clamping collider radius " << state.collider_radius << " to half a cell, " << max_radius << endl;
+		state.collider_radius = max_radius;
+		block.radius = max_radius;
+	}
+
+	const int kBrickSamples = SignedDistanceField::kBrickSamples;
+
+	int width = 0, height = 0, depth = 0, allocated = 0;
+	for (const SignedDistanceField &field : state.colliders) {
+		width = max(width, field.bricks[0]);
+		height = max(height, field.bricks[1]);
+		depth += field.bricks[2];
+		allocated += field.getAllocatedBrickCount();
+	}
+
+	// Allocated bricks are packed into a roughly cubic atlas.
+	int atlas_width = max(1, (int)ceil(cbrt((double)allocated)));
+	int atlas_depth = max(1, (allocated + atlas_width * atlas_width - 1) / (atlas_width * atlas_width));
+
+	// Each brick takes two texels along x, its entry then its direction.
+	std::vector<GLfloat> bricks(width * 2 * height * depth * 4, 0.0f);
+	std::vector<GLfloat> atlas((size_t)atlas_width * atlas_width * atlas_depth *
+		SignedDistanceField::kSamplesPerBrick, 0.0f);
+	size_t atlas_row = atlas_width * kBrickSamples;
+	size_t atlas_slice = atlas_row * atlas_row;
+
+	int slice = 0, atlas_brick = 0;
+	for (size_t c = 0; c < state.colliders.size(); ++c) {
+		const SignedDistanceField &field = state.colliders[c];
+
+		for (int z = 0; z < field.bricks[2]; ++z) {
+			for (int y = 0; y < field.bricks[1]; ++y) {
+				for (int x = 0; x < field.bricks[0]; ++x) {
+					int b = (z * field.bricks[1] + y) * field.bricks[0] + x;
+					GLfloat *entry = &bricks[(((slice + z) * height + y) * width * 2 + x * 2) * 4];
+					GLfloat *direction = entry + 4;
+					direction[0] = field.brick_direction[b].x;
+					direction[1] = field.brick_direction[b].y;
+					direction[2] = field.brick_direction[b].z;
+					if (field.brick_index[b] < 0) {
+						entry[0] = -1.0f;
+						entry[3] = field.brick_distance[b];
+						continue;
+					}
+
+					int a = atlas_brick + field.brick_index[b];
+					int ax = a % atlas_width * kBrickSamples;
+					int ay = a / atlas_width % atlas_width * kBrickSamples;
+					int az = a / (atlas_width * atlas_width) * kBrickSamples;
+					entry[0] = (GLfloat)ax;
+					entry[1] = (GLfloat)ay;
+					entry[2] = (GLfloat)az;
+
+					const float *samples = field.samples.data() +
+						(size_t)field.brick_index[b] * SignedDistanceField::kSamplesPerBrick;
+					for (int sz = 0; sz < kBrickSamples; ++sz) {
+						for (int sy = 0; sy < kBrickSamples; ++sy) {
+							memcpy(&atlas[(az + sz) * atlas_slice + (ay + sy) * atlas_row + ax],
+								samples + (sz * kBrickSamples + sy) * kBrickSamples, sizeof(float) * kBrickSamples);
+						}
+					}
+				}
+			}
+		}
+
+		block.origin[c][0] = field.origin.x;
+		block.origin[c][1] = field.origin.y;
+		block.origin[c][2] = field.origin.z;
+		block.origin[c][3] = field.cell_size;
+		block.grid[c][0] = (GLfloat)field.bricks[0];
+		block.grid[c][1] = (GLfloat)field.bricks[1];
+		block.grid[c][2] = (GLfloat)field.bricks[2];
+		block.grid[c][3] = (GLfloat)slice;
+
+		slice += field.bricks[2];
+		atlas_brick += field.getAllocatedBrickCount();
+	}
+
+	block.count = (GLfloat)state.colliders.size();
+	block.bricks_size[0] = (GLfloat)(width * 2);
+	block.bricks_size[1] = (GLfloat)height;
+	block.bricks_size[2] = (GLfloat)depth;
+	block.atlas_size[0] = (GLfloat)atlas_row;
+	block.atlas_size[1] = (GLfloat)atlas_row;
+	block.atlas_size[2] = (GLfloat)(atlas_depth * kBrickSamples);
+
+	glGenTextures(1, &kColliderBrickTexture);
+	glBindTexture(GL_TEXTURE_3D, kColliderBrickTexture);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA32F, width * 2, height, depth, 0, GL_RGBA, GL_FLOAT, bricks.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+	// Samples are filtered in hardware, bricks carry their own border.
+	glGenTextures(1, &kColliderAtlasTexture);
+	glBindTexture(GL_TEXTURE_3D, kColliderAtlasTexture);
+	glTexImage3D(GL_TEXTURE_3D, 0, GL_R32F, atlas_row, atlas_row, atlas_depth * kBrickSamples,
+		0, GL_RED, GL_FLOAT, atlas.data());
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_3D, 0);
+	GL_CHECK();
+}
+
 void cleanup() {
+	state.frame_capture.stop();
+	state.cpu_simulation.stop();
+
+	for (std::pair<const int, GLuint> &vao : kParticleVAOs) {
+		glDeleteVertexArrays(1, &vao.second);
+	}
 	glDeleteBuffers(1, &kAttributeBuffer);
 
+	state.stage_timer.destroy();
+	state.error_reduction.destroy();
+
+	state.simulation_block.destroy();
+	state.light_block.destroy();
+	state.collider_block.destroy();
+
 	glDeleteFramebuffers(2, state.frame_buffer.getBuffers());
 	glDeleteFramebuffers(1, &kDepthFBO);
 
@@ -729,6 +1440,12 @@ void cleanup() {
 	glDeleteTextures(2, state.velocity_texture.getBuffers());
 	glDeleteTextures(2, state.normal_texture.getBuffers());
 	glDeleteTextures(1, &kDepthTexture);
+	glDeleteTextures(1, &kPermutationTexture);
+	glDeleteBuffers(1, &kSortReadPBO);
+	glDeleteBuffers(1, &kSortPermutationPBO);
+	glDeleteBuffers(1, &kCpuUploadPBO);
+	glDeleteTextures(1, &kColliderBrickTexture);
+	glDeleteTextures(1, &kColliderAtlasTexture);
 
 	glDeleteFramebuffers(1, &kNoiseFBO);
 	glDeleteTextures(1, &kTextureCurlNoise);
@@ -758,11 +1475,60 @@ int main(int argc, char **argv)
 
 	cout << "OpenGL Version: " << glGetString(GL_VERSION) << endl;
 
+	// glutInit() has already removed its own arguments.
+	bool capture = false;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-capture") == 0 && i + 1 < argc) {
+			state.capture_path = argv[++i];
+			capture = true;
+		} else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc) {
+			state.governor.setBudget((float)atof(argv[++i]));
+		} else if (strcmp(argv[i], "-sort") == 0 && i + 1 < argc) {
+			state.sort_interval = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-collider") == 0 && i + 1 < argc) {
+			state.collider_paths.push_back(argv[++i]);
+		} else if (strcmp(argv[i], "-collider-resolution") == 0 && i + 1 < argc) {
+			state.collider_resolution = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-cpu") == 0) {
+			state.cpu_backend = true;
+		} else if (strcmp(argv[i], "-integrator") == 0 && i + 1 < argc) {
+			const char *name = argv[++i];
+			for (int j = 0; j < INTEGRATOR_COUNT; ++j) {
+				if (strcmp(name, getIntegratorName((Integrator)j)) == 0) {
+					state.step_controller.setIntegrator((Integrator)j);
+				}
+			}
+		} else if (strcmp(argv[i], "-timescale") == 0 && i + 1 < argc) {
+			state.time_scale = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "-dt") == 0 && i + 1 < argc) {
+			state.step_controller.setMaxStep((float)atof(argv[++i]));
+		} else if (strcmp(argv[i], "-adaptive") == 0 && i + 1 < argc) {
+			state.step_controller.setTolerance((float)atof(argv[++i]));
+		}
+	}
+
 	init();
 	generateDepthBuffer();
 	generateParticles();
 	generateNoise();
 	generateColorBuffers();
+	generateColliders();
+
+	if (state.cpu_backend) {
+		if (state.sort_interval > 0) {
+			cerr << "Ignoring -sort, Morton sorting is not available with -cpu" << endl;
+			state.sort_interval = 0;
+		}
+		startCpuSimulation();
+	}
+
+	// Setup bound objects directly, start the cache from a clean slate.
+	state.gl_state.invalidate();
+	state.last_tick = std::chrono::high_resolution_clock::now();
+
+	if (capture) {
+		toggleCapture();
+	}
 
 	glutMainLoop();
 
@@ -0,0 +1,277 @@
+#ifndef _MORTON_SORT_
+#define _MORTON_SORT_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "parallel_for.hpp"
+
+/**
+ * Spreads the low 10 bits of |v| out so that there are two
+ * zero bits between each of them.
+ */
+inline uint32_t expandBits(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+/**
+ * The 30 bit Morton code of a point in the unit cube.
+ */
+inline uint32_t mortonCode(float x, float y, float z) {
+	x = std::min(std::max(x * 1024.0f, 0.0f), 1023.0f);
+	y = std::min(std::max(y * 1024.0f, 0.0f), 1023.0f);
+	z = std::min(std::max(z * 1024.0f, 0.0f), 1023.0f);
+	return (expandBits((uint32_t)x) << 2) | (expandBits((uint32_t)y) << 1) | expandBits((uint32_t)z);
+}
+
+// Keys are split into chunks of this many for the parallel passes.
+const size_t kSortChunkSize = 65536;
+
+/**
+ * Stable LSD radix sort of |keys| by the 30 bit Morton code in their
+ * upper half. Each pass histograms chunks in parallel, offsets them by
+ * a prefix sum and scatters them in parallel, so keys with equal codes
+ * keep their order. |scratch| is the second buffer.
+ */
+inline void radixSortByCode(std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch) {
+	static const int kRadixBits = 10;
+	static const size_t kBuckets = 1 << kRadixBits;
+
+	size_t count = keys.size();
+	size_t chunk_count = (count + kSortChunkSize - 1) / kSortChunkSize;
+	scratch.resize(count);
+	std::vector<size_t> offsets(chunk_count * kBuckets);
+
+	for (int shift = 32; shift < 62; shift += kRadixBits) {
+		std::fill(offsets.begin(), offsets.end(), 0);
+		parallelFor(chunk_count, [&](size_t chunk) {
+			size_t *histogram = &offsets[chunk * kBuckets];
+			size_t last = std::min(count, (chunk + 1) * kSortChunkSize);
+			for (size_t i = chunk * kSortChunkSize; i < last; ++i) {
+				++histogram[(keys[i] >> shift) & (kBuckets - 1)];
+			}
+		});
+
+		// Bucket major, then chunk, so earlier chunks land first.
+		size_t total = 0;
+		for (size_t bucket = 0; bucket < kBuckets; ++bucket) {
+			for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+				size_t bucket_count = offsets[chunk * kBuckets + bucket];
+				offsets[chunk * kBuckets + bucket] = total;
+				total += bucket_count;
+			}
+		}
+
+		parallelFor(chunk_count, [&](size_t chunk) {
+			size_t *offset = &offsets[chunk * kBuckets];
+			size_t last = std::min(count, (chunk + 1) * kSortChunkSize);
+			for (size_t i = chunk * kSortChunkSize; i < last; ++i) {
+				scratch[offset[(keys[i] >> shift) & (kBuckets - 1)]++] = keys[i];
+			}
+		});
+		keys.swap(scratch);
+	}
+}
+
+/**
+ * Computes the Morton order of |count| RGBA |positions| within their
+ * bounding box. On return |order[i]| is the texel which should move
+ * to texel i.
+ */
+inline void mortonOrder(const float *positions, size_t count, std::vector<uint32_t> &order) {
+	size_t chunk_count = (count + kSortChunkSize - 1) / kSortChunkSize;
+
+	std::vector<float> bounds(chunk_count * 6);
+	parallelFor(chunk_count, [&](size_t chunk) {
+		float *min = &bounds[chunk * 6];
+		float *max = min + 3;
+		size_t first = chunk * kSortChunkSize;
+		size_t last = std::min(count, first + kSortChunkSize);
+		for (int j = 0; j < 3; ++j) {
+			min[j] = max[j] = positions[first * 4 + j];
+		}
+		for (size_t i = first; i < last; ++i) {
+			for (int j = 0; j < 3; ++j) {
+				min[j] = std::min(min[j], positions[i * 4 + j]);
+				max[j] = std::max(max[j], positions[i * 4 + j]);
+			}
+		}
+	});
+
+	float min[3] = { bounds[0], bounds[1], bounds[2] };
+	float max[3] = { bounds[3], bounds[4], bounds[5] };
+	for (size_t chunk = 1; chunk < chunk_count; ++chunk) {
+		for (int j = 0; j < 3; ++j) {
+			min[j] = std::min(min[j], bounds[chunk * 6 + j]);
+			max[j] = std::max(max[j], bounds[chunk * 6 + 3 + j]);
+		}
+	}
+
+	float scale[3];
+	for (int j = 0; j < 3; ++j) {
+		scale[j] = max[j] > min[j] ? 1.0f / (max[j] - min[j]) : 0.0f;
+	}
+
+	// The texel rides along in the low half of each key.
+	std::vector<uint64_t> keys(count);
+	parallelFor(chunk_count, [&](size_t chunk) {
+		size_t last = std::min(count, (chunk + 1) * kSortChunkSize);
+		for (size_t i = chunk * kSortChunkSize; i < last; ++i) {
+			const float *p = positions + i * 4;
+			uint64_t code = mortonCode(
+				(p[0] - min[0]) * scale[0],
+				(p[1] - min[1]) * scale[1],
+				(p[2] - min[2]) * scale[2]);
+			keys[i] = (code << 32) | (uint64_t)i;
+		}
+	});
+
+	std::vector<uint64_t> scratch;
+	radixSortByCode(keys, scratch);
+
+	order.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		order[i] = (uint32_t)keys[i];
+	}
+}
+
+/**
+ * Computes the Morton order on a thread of its own so the render loop
+ * keeps running while it sorts.
+ */
+class MortonSorter
+{
+public:
+	MortonSorter() {
+		done = false;
+	}
+
+	~MortonSorter() {
+		if (thread.joinable()) {
+			thread.join();
+		}
+	}
+
+	bool isRunning() const {
+		return thread.joinable();
+	}
+
+	bool isDone() const {
+		return done;
+	}
+
+	/**
+	 * Starts sorting |width| x |height| RGBA |positions|, writing the RG
+	 * texture coordinates each texel gathers from into |permutation|.
+	 * Both must stay valid until the sorter is done.
+	 */
+	void start(const float *positions, float *permutation, size_t width, size_t height) {
+		done = false;
+		thread = std::thread([=]() {
+			std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+
+			size_t count = width * height;
+			std::vector<uint32_t> order;
+			mortonOrder(positions, count, order);
+
+			size_t chunk_count = (count + kSortChunkSize - 1) / kSortChunkSize;
+			parallelFor(chunk_count, [&](size_t chunk) {
+				size_t last = std::min(count, (chunk + 1) * kSortChunkSize);
+				for (size_t i = chunk * kSortChunkSize; i < last; ++i) {
+					permutation[i * 2 + 0] = (order[i] % width + 0.5f) / width;
+					permutation[i * 2 + 1] = (order[i] / width + 0.5f) / height;
+				}
+			});
+
+			milliseconds = std::chrono::duration<double, std::milli>(
+				std::chrono::high_resolution_clock::now() - begin).count();
+			done = true;
+		});
+	}
+
+	/**
+	 * Joins the finished sort, returning how long it took.
+	 */
+	double finish() {
+		thread.join();
+		return milliseconds;
+	}
+
+private:
+	std::thread thread;
+	std::atomic<bool> done;
+	double milliseconds = 0.0;
+};
+
+/**
+ * Averages the update and render times over the frames before and
+ * after each sort, so the effect of sorting can be read off the log.
+ * A sort arriving before the after window is full cuts it short.
+ */
+class SortBenchmark
+{
+public:
+	static const int kWindowFrames = 120;
+	// Stage timings arrive a few frames late.
+	static const int kSettleFrames = 4;
+
+	void record(float update_milliseconds, float render_milliseconds) {
+		if (settle > 0) {
+			--settle;
+			return;
+		}
+
+		update_sum += update_milliseconds;
+		render_sum += render_milliseconds;
+		++frames;
+
+		if (measuring_after && frames == kWindowFrames) {
+			report("after");
+			measuring_after = false;
+		}
+	}
+
+	/**
+	 * Called when a sort happens.
+	 */
+	void sorted(double sort_milliseconds, double render_milliseconds) {
+		std::cout << "Morton sort took " << sort_milliseconds << " ms on its thread, "
+			<< render_milliseconds << " ms on the render thread" << std::endl;
+		// With sorts closer together than a window, report what there is.
+		if (frames > 0) {
+			report(measuring_after ? "after (partial)" : "before");
+		}
+		update_sum = 0.0;
+		render_sum = 0.0;
+		frames = 0;
+		settle = kSettleFrames;
+		measuring_after = true;
+	}
+
+private:
+	void report(const char *when) {
+		std::cout << "Morton sort " << when << ": update " << update_sum / frames
+			<< " ms, render " << render_sum / frames << " ms over " << frames << " frames" << std::endl;
+		update_sum = 0.0;
+		render_sum = 0.0;
+		frames = 0;
+	}
+
+	double update_sum = 0.0;
+	double render_sum = 0.0;
+	int frames = 0;
+	int settle = 0;
+
+	bool measuring_after = false;
+};
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _PARALLEL_FOR_
+#define _PARALLEL_FOR_
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * Calls |f(i)| for every i in [0, count) across all hardware threads.
+ */
+template <typename F>
+void parallelFor(size_t count, F f) {
+	unsigned int thread_count = std::max(1u, std::thread::hardware_concurrency());
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&]() {
+			for (size_t i = next++; i < count; i = next++) {
+				f(i);
+			}
+		});
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+#endif
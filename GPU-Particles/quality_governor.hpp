@@ -0,0 +1,261 @@
+#ifndef _QUALITY_GOVERNOR_
+#define _QUALITY_GOVERNOR_
+
+#include <iostream>
+#include <vector>
+
+#include "Utility\gl.hpp"
+
+enum Stage
+{
+	UPDATE_STAGE = 0,
+	SHADOW_STAGE,
+	RENDER_STAGE,
+	STAGE_COUNT,
+};
+
+/**
+ * GPU timings of each frame stage, measured with timer queries.
+ * Results are read a few frames late so that reading never stalls.
+ */
+class StageTimer
+{
+public:
+	static const int kFrameLatency = 3;
+
+	void create() {
+		glGenQueries(kFrameLatency * STAGE_COUNT, &queries[0][0]);
+		for (int i = 0; i < kFrameLatency; ++i) {
+			for (int j = 0; j < STAGE_COUNT; ++j) {
+				issued[i][j] = false;
+			}
+		}
+	}
+
+	void destroy() {
+		glDeleteQueries(kFrameLatency * STAGE_COUNT, &queries[0][0]);
+	}
+
+	/**
+	 * Collects the oldest frame's results, if available, and
+	 * recycles its queries for the new frame.
+	 */
+	void beginFrame() {
+		frame = (frame + 1) % kFrameLatency;
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			if (!issued[frame][i]) {
+				milliseconds[i] = 0.0f;
+				continue;
+			}
+			GLint available = 0;
+			glGetQueryObjectiv(queries[frame][i], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (available) {
+				GLuint64 nanoseconds = 0;
+				glGetQueryObjectui64v(queries[frame][i], GL_QUERY_RESULT, &nanoseconds);
+				milliseconds[i] = nanoseconds / 1000000.0f;
+			}
+			issued[frame][i] = false;
+		}
+	}
+
+	void begin(Stage stage) {
+		glBeginQuery(GL_TIME_ELAPSED, queries[frame][stage]);
+		issued[frame][stage] = true;
+	}
+
+	void end() {
+		glEndQuery(GL_TIME_ELAPSED);
+	}
+
+	float getMilliseconds(Stage stage) const {
+		return milliseconds[stage];
+	}
+
+private:
+	GLuint queries[kFrameLatency][STAGE_COUNT];
+	bool issued[kFrameLatency][STAGE_COUNT];
+
+	int frame = 0;
+
+	float milliseconds[STAGE_COUNT] = { 0.0f, 0.0f, 0.0f };
+};
+
+/**
+ * The quality knobs the governor is allowed to turn.
+ */
+struct QualitySettings
+{
+	// Only every Nth particle is drawn.
+	int particle_stride = 1;
+
+	// Side of the shadow map in texels, 0 disables shadows.
+	int shadow_resolution = 512;
+	// Only every Nth drawn particle casts a shadow.
+	int caster_stride = 1;
+
+	// Each particle evaluates curl noise every Nth update.
+	int noise_rate = 1;
+};
+
+/**
+ * Adjusts the quality settings to keep the frame time within a budget.
+ *
+ * Each stage has a ladder of settings. When the smoothed frame time is
+ * over budget because of the GPU stages, the most expensive stage steps
+ * down its ladder; when the GPU has plenty of headroom the most recent
+ * step down is undone. A cool-down after every change and separate
+ * up/down thresholds stop it oscillating.
+ */
+class QualityGovernor
+{
+public:
+	static const int kCooldownFrames = 30;
+
+	QualityGovernor() {
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			levels[i] = 0;
+			stage_milliseconds[i] = 0.0f;
+		}
+	}
+
+	void setBudget(float milliseconds) {
+		budget = milliseconds;
+	}
+
+	float getBudget() const {
+		return budget;
+	}
+
+	void setEnabled(bool is_enabled) {
+		enabled = is_enabled;
+	}
+
+	bool isEnabled() const {
+		return enabled;
+	}
+
+	/**
+	 * The update ladder only thins out curl noise, so it is
+	 * not stepped down while the noise is off.
+	 */
+	void setNoiseEnabled(bool is_enabled) {
+		noise_enabled = is_enabled;
+	}
+
+	const QualitySettings &getSettings() const {
+		return settings;
+	}
+
+	/**
+	 * Feeds one frame's timings, returns true if the settings changed.
+	 */
+	bool update(float frame_milliseconds, const StageTimer &timer) {
+		frame_time = smooth(frame_time, frame_milliseconds);
+		gpu_time = 0.0f;
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			stage_milliseconds[i] = smooth(stage_milliseconds[i], timer.getMilliseconds((Stage)i));
+			gpu_time += stage_milliseconds[i];
+		}
+
+		if (!enabled || ++frames_since_change < kCooldownFrames) {
+			return false;
+		}
+
+		// Only step down when the GPU stages explain the overrun. A frame held
+		// back by a slower display, the CPU simulation or capture would not get
+		// any faster, it would only lose quality for good.
+		float load = frame_time > gpu_time ? frame_time : gpu_time;
+		if (load > budget * 1.05f && gpu_time > budget * 0.9f) {
+			return stepDown();
+		}
+		// With GPU headroom a step back up cannot be what holds the frame back.
+		if (gpu_time < budget * 0.7f) {
+			return stepUp();
+		}
+		return false;
+	}
+
+private:
+	static float smooth(float average, float sample) {
+		return average * 0.9f + sample * 0.1f;
+	}
+
+	bool stepDown() {
+		// Number of settings on each stage's ladder, see apply().
+		static const int kLevels[STAGE_COUNT] = { 4, 6, 4 };
+
+		// Degrade the most expensive stage which still has room to.
+		int worst = -1;
+		for (int i = 0; i < STAGE_COUNT; ++i) {
+			if (i == UPDATE_STAGE && !noise_enabled) {
+				continue;
+			}
+			if (levels[i] + 1 < kLevels[i] &&
+				(worst < 0 || stage_milliseconds[i] > stage_milliseconds[worst])) {
+				worst = i;
+			}
+		}
+		if (worst < 0) {
+			return false;
+		}
+		++levels[worst];
+		history.push_back(worst);
+		apply("down", (Stage)worst);
+		return true;
+	}
+
+	bool stepUp() {
+		if (history.empty()) {
+			return false;
+		}
+		int stage = history.back();
+		history.pop_back();
+		--levels[stage];
+		apply("up", (Stage)stage);
+		return true;
+	}
+
+	void apply(const char *direction, Stage stage) {
+		static const int kParticleStrides[] = { 1, 2, 3, 4 };
+		static const int kShadowResolutions[] = { 512, 512, 256, 256, 128, 0 };
+		static const int kCasterStrides[] = { 1, 2, 2, 4, 4, 4 };
+		static const int kNoiseRates[] = { 1, 2, 4, 8 };
+
+		settings.particle_stride = kParticleStrides[levels[RENDER_STAGE]];
+		settings.shadow_resolution = kShadowResolutions[levels[SHADOW_STAGE]];
+		settings.caster_stride = kCasterStrides[levels[SHADOW_STAGE]];
+		settings.noise_rate = kNoiseRates[levels[UPDATE_STAGE]];
+
+		frames_since_change = 0;
+
+		static const char *kStageNames[] = { "update", "shadow", "render" };
+		std::cout << "Quality " << direction << " (" << kStageNames[stage] << ")"
+			<< ": frame " << frame_time << " ms, gpu " << gpu_time << " ms"
+			<< " [update " << stage_milliseconds[UPDATE_STAGE]
+			<< ", shadow " << stage_milliseconds[SHADOW_STAGE]
+			<< ", render " << stage_milliseconds[RENDER_STAGE] << "]"
+			<< ", budget " << budget << " ms"
+			<< " -> particles 1/" << settings.particle_stride
+			<< ", shadow map " << settings.shadow_resolution
+			<< ", caster stride " << settings.caster_stride
+			<< ", noise rate " << settings.noise_rate << std::endl;
+	}
+
+	bool enabled = true;
+	bool noise_enabled = true;
+
+	float budget = 1000.0f / 60.0f;
+
+	float frame_time = 0.0f;
+	float gpu_time = 0.0f;
+	float stage_milliseconds[STAGE_COUNT];
+
+	int levels[STAGE_COUNT];
+	std::vector<int> history;
+
+	int frames_since_change = 0;
+
+	QualitySettings settings;
+};
+
+#endif
@@ -0,0 +1,20 @@
+// Fragment shader for reducing a texture to its maximum.
+// Each texel takes the maximum of a 4x4 block of the source.
+
+uniform sampler2D source;
+uniform vec2 source_size;
+uniform vec4 channel; // Selects the reduced channel of the source
+
+void main()
+{
+	vec2 first = floor(gl_FragCoord.xy) * 4.0;
+	float result = 0.0;
+	for (int y = 0; y < 4; ++y) {
+		for (int x = 0; x < 4; ++x) {
+			// Clamping only revisits texels, which cannot change the maximum.
+			vec2 texel = min(first + vec2(x, y), source_size - 1.0);
+			result = max(result, dot(texture2D(source, (texel + 0.5) / source_size), channel));
+		}
+	}
+	gl_FragColor = vec4(result);
+}
\ No newline at end of file
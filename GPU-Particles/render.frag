@@ -1,5 +1,7 @@
 // Fragment shader for rendering particles.
 
+#extension GL_ARB_uniform_buffer_object : enable
+
 varying float life;
 varying vec3 FragmentPosition;
 varying vec3 EyeVector;
@@ -7,10 +9,17 @@ varying vec3 ShadowCoord;
 
 uniform sampler2D shadowMap;
 uniform sampler2D normals;
-uniform vec4 global_ambient;
 
-uniform float life_fade;
-uniform vec4 light[4];
+// Must match LightBlock in main.cpp and render.vert.
+layout(std140) uniform LightBlock
+{
+	vec4 light[4];
+	mat4 lightMVP;
+	mat4 lightBias;
+	vec4 global_ambient;
+	float life_fade;
+	float shadows;
+};
 
 void main()
 {
@@ -29,7 +38,7 @@ void main()
 	gl_FragColor = vec4(0.1, 0.0, 0.0, 1); // Scene color
 
 	float bias = 0.01;
-	if (texture2D(shadowMap, ShadowCoord.xy).z >= ShadowCoord.z - bias) {
+	if (shadows < 0.5 || texture2D(shadowMap, ShadowCoord.xy).z >= ShadowCoord.z - bias) {
 		// light.falloff.x
 		// light.falloff.y
 		// light.falloff.z
@@ -1,13 +1,23 @@
 // Vertex shader for rendering particles.
 
+#extension GL_ARB_uniform_buffer_object : enable
+
 attribute vec2 index;
 //attribute float linehead;
 
 uniform sampler2D positions;
 uniform sampler2D velocities;
 
-uniform mat4 lightMVP;
-uniform mat4 lightBias;
+// Must match LightBlock in main.cpp and render.frag.
+layout(std140) uniform LightBlock
+{
+	vec4 light[4];
+	mat4 lightMVP;
+	mat4 lightBias;
+	vec4 global_ambient;
+	float life_fade;
+	float shadows;
+};
 
 varying float life;
 varying vec3 FragmentPosition;
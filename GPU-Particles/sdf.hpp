@@ -0,0 +1,599 @@
+#ifndef _SDF_
+#define _SDF_
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "parallel_for.hpp"
+
+struct Point3
+{
+	float x = 0.0f;
+	float y = 0.0f;
+	float z = 0.0f;
+
+	Point3() {}
+	Point3(float x, float y, float z) : x(x), y(y), z(z) {}
+
+	float &operator[](int i) { return (&x)[i]; }
+	float operator[](int i) const { return (&x)[i]; }
+
+	Point3 operator+(const Point3 &o) const { return Point3(x + o.x, y + o.y, z + o.z); }
+	Point3 operator-(const Point3 &o) const { return Point3(x - o.x, y - o.y, z - o.z); }
+	Point3 operator*(float s) const { return Point3(x * s, y * s, z * s); }
+};
+
+inline float dot(const Point3 &a, const Point3 &b) {
+	return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+inline Point3 cross(const Point3 &a, const Point3 &b) {
+	return Point3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+inline Point3 normalize(const Point3 &a) {
+	float length = sqrt(dot(a, a));
+	return length > 0.0f ? a * (1.0f / length) : a;
+}
+
+struct Triangle
+{
+	Point3 v[3];
+};
+
+/**
+ * FNV-1a, used to tell whether a cached bake is still current.
+ */
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+/**
+ * Loads the triangles of a Wavefront OBJ, fanning polygons. Only
+ * positions are read. |hash| receives a hash of the file contents.
+ */
+inline bool loadObj(const std::string &path, std::vector<Triangle> &triangles, uint64_t *hash) {
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file) {
+		std::cerr << "Failed to open mesh: " << path << std::endl;
+		return false;
+	}
+	std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	*hash = hashBytes(contents.data(), contents.size());
+
+	std::vector<Point3> vertices;
+	std::istringstream lines(contents);
+	std::string line;
+	while (std::getline(lines, line)) {
+		std::istringstream tokens(line);
+		std::string type;
+		tokens >> type;
+		if (type == "v") {
+			Point3 v;
+			tokens >> v.x >> v.y >> v.z;
+			vertices.push_back(v);
+		} else if (type == "f") {
+			std::vector<int> face;
+			std::string vertex;
+			while (tokens >> vertex) {
+				// "v", "v/vt", "v//vn" or "v/vt/vn", negative indices are relative.
+				int index = atoi(vertex.c_str());
+				index = index < 0 ? (int)vertices.size() + index : index - 1;
+				if (index < 0 || index >= (int)vertices.size()) {
+					std::cerr << "Bad face in mesh: " << path << std::endl;
+					return false;
+				}
+				face.push_back(index);
+			}
+			for (size_t i = 2; i < face.size(); ++i) {
+				Triangle triangle;
+				triangle.v[0] = vertices[face[0]];
+				triangle.v[1] = vertices[face[i - 1]];
+				triangle.v[2] = vertices[face[i]];
+				triangles.push_back(triangle);
+			}
+		}
+	}
+	return !triangles.empty();
+}
+
+/**
+ * The point on triangle abc closest to p, from Ericson's
+ * Real-Time Collision Detection.
+ */
+inline Point3 closestPointOnTriangle(const Point3 &p, const Point3 &a, const Point3 &b, const Point3 &c) {
+	Point3 ab = b - a;
+	Point3 ac = c - a;
+	Point3 ap = p - a;
+	float d1 = dot(ab, ap);
+	float d2 = dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+	Point3 bp = p - b;
+	float d3 = dot(ab, bp);
+	float d4 = dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3) return b;
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+		return a + ab * (d1 / (d1 - d3));
+	}
+
+	Point3 cp = p - c;
+	float d5 = dot(ab, cp);
+	float d6 = dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6) return c;
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+		return a + ac * (d2 / (d2 - d6));
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+		return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+	}
+
+	float denom = 1.0f / (va + vb + vc);
+	return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+/**
+ * A bounding volume hierarchy answering signed distance queries
+ * against a triangle soup.
+ */
+class TriangleBVH
+{
+public:
+	static const int kLeafSize = 4;
+
+	explicit TriangleBVH(const std::vector<Triangle> &mesh) : triangles(mesh) {
+		normals.resize(triangles.size());
+		order.resize(triangles.size());
+		for (size_t i = 0; i < triangles.size(); ++i) {
+			const Triangle &t = triangles[i];
+			normals[i] = normalize(cross(t.v[1] - t.v[0], t.v[2] - t.v[0]));
+			order[i] = (int)i;
+		}
+		if (!triangles.empty()) {
+			build(0, (int)triangles.size());
+		}
+	}
+
+	/**
+	 * The distance from |p| to the mesh, negative on the back
+	 * side of the closest triangle.
+	 */
+	float signedDistance(const Point3 &p) const {
+		float best = FLT_MAX;
+		float best_alignment = 0.0f;
+		float best_side = 1.0f;
+
+		int stack[64];
+		int depth = 0;
+		stack[depth++] = 0;
+		while (depth > 0) {
+			const Node &node = nodes[stack[--depth]];
+			if (boxDistanceSquared(node, p) > best) {
+				continue;
+			}
+			if (node.count > 0) {
+				for (int i = node.first; i < node.first + node.count; ++i) {
+					const Triangle &t = triangles[order[i]];
+					Point3 offset = p - closestPointOnTriangle(p, t.v[0], t.v[1], t.v[2]);
+					float distance = dot(offset, offset);
+					// Near edges and corners several triangles tie, trust the one
+					// facing the point most directly for the sign.
+					float side = dot(offset, normals[order[i]]);
+					float alignment = distance > 0.0f ? fabs(side) / sqrt(distance) : 1.0f;
+					if (distance < best * (1.0f - 1e-5f) ||
+						(distance <= best * (1.0f + 1e-5f) && alignment > best_alignment)) {
+						best = distance;
+						best_alignment = alignment;
+						best_side = side < 0.0f ? -1.0f : 1.0f;
+					}
+				}
+			} else {
+				int near_child = node.first;
+				int far_child = node.first + 1;
+				if (boxDistanceSquared(nodes[far_child], p) < boxDistanceSquared(nodes[near_child], p)) {
+					std::swap(near_child, far_child);
+				}
+				stack[depth++] = far_child;
+				stack[depth++] = near_child;
+			}
+		}
+		return best_side * sqrt(best);
+	}
+
+private:
+	struct Node
+	{
+		Point3 min;
+		Point3 max;
+		// Index of the first child for inner nodes, of the first triangle for leaves.
+		int first = 0;
+		int count = 0;
+	};
+
+	static float boxDistanceSquared(const Node &node, const Point3 &p) {
+		float distance = 0.0f;
+		for (int i = 0; i < 3; ++i) {
+			float d = std::max(std::max(node.min[i] - p[i], p[i] - node.max[i]), 0.0f);
+			distance += d * d;
+		}
+		return distance;
+	}
+
+	void build(int first, int count) {
+		nodes.push_back(Node());
+		build(0, first, count);
+	}
+
+	/**
+	 * Fills in the node at |index| over |count| triangles from |first|.
+	 */
+	void build(int index, int first, int count) {
+		Point3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+		Point3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		Point3 centroid_min = min;
+		Point3 centroid_max = max;
+		for (int i = first; i < first + count; ++i) {
+			const Triangle &t = triangles[order[i]];
+			Point3 centroid = (t.v[0] + t.v[1] + t.v[2]) * (1.0f / 3.0f);
+			for (int j = 0; j < 3; ++j) {
+				for (int k = 0; k < 3; ++k) {
+					min[j] = std::min(min[j], t.v[k][j]);
+					max[j] = std::max(max[j], t.v[k][j]);
+				}
+				centroid_min[j] = std::min(centroid_min[j], centroid[j]);
+				centroid_max[j] = std::max(centroid_max[j], centroid[j]);
+			}
+		}
+		nodes[index].min = min;
+		nodes[index].max = max;
+
+		if (count <= kLeafSize) {
+			nodes[index].first = first;
+			nodes[index].count = count;
+			return;
+		}
+
+		// Median split along the longest axis of the centroids.
+		Point3 extent = centroid_max - centroid_min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		int half = count / 2;
+		const std::vector<Triangle> &mesh = triangles;
+		std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+			[&mesh, axis](int a, int b) {
+				return mesh[a].v[0][axis] + mesh[a].v[1][axis] + mesh[a].v[2][axis] <
+					mesh[b].v[0][axis] + mesh[b].v[1][axis] + mesh[b].v[2][axis];
+			});
+
+		// Children are allocated next to each other.
+		int left = (int)nodes.size();
+		nodes.push_back(Node());
+		nodes.push_back(Node());
+		nodes[index].first = left;
+		nodes[index].count = 0;
+
+		build(left, first, half);
+		build(left + 1, first + half, count - half);
+	}
+
+	const std::vector<Triangle> &triangles;
+	std::vector<Point3> normals;
+	std::vector<int> order;
+	std::vector<Node> nodes;
+};
+
+/**
+ * A signed distance field stored as a grid of bricks. Only bricks the
+ * surface passes through hold samples; every other brick only stores a
+ * conservative distance, so memory follows surface area rather than volume.
+ *
+ * Each brick covers kBrickCells cells and stores the kBrickSamples
+ * corner samples of those cells, so neighbouring bricks share a face of
+ * samples and trilinear filtering never has to look outside a brick.
+ */
+class SignedDistanceField
+{
+public:
+	static const int kBrickCells = 7;
+	static const int kBrickSamples = kBrickCells + 1;
+	static const int kSamplesPerBrick = kBrickSamples * kBrickSamples * kBrickSamples;
+
+	Point3 origin;
+	float cell_size = 0.0f;
+	int bricks[3] = { 0, 0, 0 };
+
+	// Per brick, the index of its samples or -1 if it is not allocated.
+	std::vector<int32_t> brick_index;
+	// Per brick, a bound on the distance of unallocated bricks.
+	std::vector<float> brick_distance;
+	// Per brick, the outward direction at its centre, for where the
+	// samples cannot give a gradient.
+	std::vector<Point3> brick_direction;
+	// kSamplesPerBrick samples of each allocated brick, x fastest.
+	std::vector<float> samples;
+
+	int getBrickCount() const {
+		return bricks[0] * bricks[1] * bricks[2];
+	}
+
+	int getAllocatedBrickCount() const {
+		return (int)(samples.size() / kSamplesPerBrick);
+	}
+
+	/**
+	 * Loads the field of the mesh at |path| from its cache next to it,
+	 * baking and caching it first if the cache is missing or stale.
+	 * |resolution| is the number of cells along the longest axis.
+	 */
+	bool loadOrBake(const std::string &path, int resolution) {
+		std::vector<Triangle> triangles;
+		uint64_t hash = 0;
+		if (!loadObj(path, triangles, &hash)) {
+			return false;
+		}
+		hash = hashBytes(&resolution, sizeof(resolution), hash);
+
+		std::string cache_path = path + ".sdf";
+		if (load(cache_path, hash)) {
+			return true;
+		}
+
+		std::chrono::high_resolution_clock::time_point begin = std::chrono::high_resolution_clock::now();
+		bake(triangles, resolution);
+		std::cout << "Baked " << path << " (" << triangles.size() << " triangles) into "
+			<< getAllocatedBrickCount() << "/" << getBrickCount() << " bricks in "
+			<< std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - begin).count()
+			<< " s" << std::endl;
+
+		save(cache_path, hash);
+		return true;
+	}
+
+	void bake(const std::vector<Triangle> &triangles, int resolution) {
+		Point3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+		Point3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (const Triangle &t : triangles) {
+			for (int k = 0; k < 3; ++k) {
+				for (int j = 0; j < 3; ++j) {
+					min[j] = std::min(min[j], t.v[k][j]);
+					max[j] = std::max(max[j], t.v[k][j]);
+				}
+			}
+		}
+		Point3 extent = max - min;
+		cell_size = std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f)) / resolution;
+
+		// Leave a brick of margin so particles approaching from outside see the field.
+		float brick_size = cell_size * kBrickCells;
+		origin = min - Point3(brick_size, brick_size, brick_size);
+		for (int i = 0; i < 3; ++i) {
+			bricks[i] = (int)ceil((extent[i] + 2.0f * brick_size) / brick_size);
+		}
+
+		TriangleBVH bvh(triangles);
+
+		// Decide which bricks the surface can pass through from their centres.
+		int brick_count = getBrickCount();
+		float half_diagonal = 0.5f * sqrt(3.0f) * brick_size;
+		brick_distance.resize(brick_count);
+		brick_direction.resize(brick_count);
+		parallelFor(brick_count, [&](size_t i) {
+			Point3 centre = brickOrigin((int)i) + Point3(0.5f, 0.5f, 0.5f) * brick_size;
+			brick_distance[i] = bvh.signedDistance(centre);
+
+			float e = cell_size;
+			Point3 direction(
+				bvh.signedDistance(centre + Point3(e, 0, 0)) - bvh.signedDistance(centre - Point3(e, 0, 0)),
+				bvh.signedDistance(centre + Point3(0, e, 0)) - bvh.signedDistance(centre - Point3(0, e, 0)),
+				bvh.signedDistance(centre + Point3(0, 0, e)) - bvh.signedDistance(centre - Point3(0, 0, e)));
+			// Centres equidistant from opposite faces have no direction, any will do.
+			brick_direction[i] = dot(direction, direction) > 0.0f ? normalize(direction) : Point3(0.0f, 1.0f, 0.0f);
+		});
+
+		int allocated = 0;
+		brick_index.resize(brick_count);
+		for (int i = 0; i < brick_count; ++i) {
+			float distance = brick_distance[i];
+			if (fabs(distance) <= half_diagonal + cell_size) {
+				brick_index[i] = allocated++;
+				brick_distance[i] = 0.0f;
+			} else {
+				brick_index[i] = -1;
+				brick_distance[i] = distance > 0.0f ? distance - half_diagonal : distance + half_diagonal;
+			}
+		}
+
+		samples.resize((size_t)allocated * kSamplesPerBrick);
+		parallelFor(brick_count, [&](size_t i) {
+			if (brick_index[i] < 0) {
+				return;
+			}
+			Point3 corner = brickOrigin((int)i);
+			float *brick = samples.data() + (size_t)brick_index[i] * kSamplesPerBrick;
+			for (int z = 0; z < kBrickSamples; ++z) {
+				for (int y = 0; y < kBrickSamples; ++y) {
+					for (int x = 0; x < kBrickSamples; ++x) {
+						Point3 p = corner + Point3((float)x, (float)y, (float)z) * cell_size;
+						brick[(z * kBrickSamples + y) * kBrickSamples + x] = bvh.signedDistance(p);
+					}
+				}
+			}
+		});
+	}
+
+	/**
+	 * The signed distance at |p|, FLT_MAX outside the field.
+	 */
+	float sample(const Point3 &p) const {
+		Point3 cell = (p - origin) * (1.0f / cell_size);
+		int brick[3];
+		for (int i = 0; i < 3; ++i) {
+			brick[i] = (int)floor(cell[i] / kBrickCells);
+			if (brick[i] < 0 || brick[i] >= bricks[i]) {
+				return FLT_MAX;
+			}
+		}
+		int b = (brick[2] * bricks[1] + brick[1]) * bricks[0] + brick[0];
+		if (brick_index[b] < 0) {
+			return brick_distance[b];
+		}
+
+		const float *data = samples.data() + (size_t)brick_index[b] * kSamplesPerBrick;
+		int i0[3];
+		float t[3];
+		for (int i = 0; i < 3; ++i) {
+			float local = cell[i] - brick[i] * kBrickCells;
+			i0[i] = std::min((int)local, kBrickCells - 1);
+			t[i] = local - i0[i];
+		}
+
+		float result = 0.0f;
+		for (int corner = 0; corner < 8; ++corner) {
+			int dx = corner & 1, dy = (corner >> 1) & 1, dz = (corner >> 2) & 1;
+			float weight = (dx ? t[0] : 1.0f - t[0]) * (dy ? t[1] : 1.0f - t[1]) * (dz ? t[2] : 1.0f - t[2]);
+			result += weight * data[((i0[2] + dz) * kBrickSamples + i0[1] + dy) * kBrickSamples + i0[0] + dx];
+		}
+		return result;
+	}
+
+	/**
+	 * The normalized gradient at |p| by central differences. Inside
+	 * unallocated bricks, or where the differences cancel out, this is
+	 * the direction stored with the brick instead.
+	 */
+	Point3 gradient(const Point3 &p) const {
+		int b = brickAt(p);
+		if (b >= 0 && brick_index[b] < 0) {
+			return brick_direction[b];
+		}
+
+		float e = 0.5f * cell_size;
+		Point3 gradient(
+			sample(p + Point3(e, 0, 0)) - sample(p - Point3(e, 0, 0)),
+			sample(p + Point3(0, e, 0)) - sample(p - Point3(0, e, 0)),
+			sample(p + Point3(0, 0, e)) - sample(p - Point3(0, 0, e)));
+		if (dot(gradient, gradient) > 1e-6f * e * e || b < 0) {
+			return normalize(gradient);
+		}
+		return brick_direction[b];
+	}
+
+	/**
+	 * Pushes a particle of |radius| at |position| out of the surface and
+	 * reflects its |velocity|, mirroring the collision in update.frag.
+	 */
+	bool collide(Point3 &position, Point3 &velocity, float radius, float restitution, float friction) const {
+		float distance = sample(position);
+		if (distance >= radius) {
+			return false;
+		}
+		Point3 normal = gradient(position);
+		if (dot(normal, normal) == 0.0f) {
+			return false;
+		}
+		position = position + normal * (radius - distance);
+
+		float normal_speed = dot(velocity, normal);
+		if (normal_speed < 0.0f) {
+			Point3 tangent = velocity - normal * normal_speed;
+			velocity = tangent * (1.0f - friction) - normal * (restitution * normal_speed);
+		}
+		return true;
+	}
+
+private:
+	static const uint32_t kCacheMagic = 0x32464453; // "SDF2"
+
+	/**
+	 * The brick containing |p|, or -1 outside the grid.
+	 */
+	int brickAt(const Point3 &p) const {
+		int brick[3];
+		for (int i = 0; i < 3; ++i) {
+			brick[i] = (int)floor((p[i] - origin[i]) / cell_size / kBrickCells);
+			if (brick[i] < 0 || brick[i] >= bricks[i]) {
+				return -1;
+			}
+		}
+		return (brick[2] * bricks[1] + brick[1]) * bricks[0] + brick[0];
+	}
+
+	Point3 brickOrigin(int brick) const {
+		int x = brick % bricks[0];
+		int y = (brick / bricks[0]) % bricks[1];
+		int z = brick / (bricks[0] * bricks[1]);
+		return origin + Point3((float)x, (float)y, (float)z) * (cell_size * kBrickCells);
+	}
+
+	bool load(const std::string &path, uint64_t hash) {
+		FILE *file = fopen(path.c_str(), "rb");
+		if (file == NULL) {
+			return false;
+		}
+
+		uint32_t magic = 0;
+		uint64_t file_hash = 0;
+		int32_t allocated = 0;
+		bool ok = fread(&magic, sizeof(magic), 1, file) == 1 && magic == kCacheMagic &&
+			fread(&file_hash, sizeof(file_hash), 1, file) == 1 && file_hash == hash &&
+			fread(&origin.x, sizeof(float), 3, file) == 3 &&
+			fread(&cell_size, sizeof(cell_size), 1, file) == 1 &&
+			fread(bricks, sizeof(int), 3, file) == 3 &&
+			fread(&allocated, sizeof(allocated), 1, file) == 1;
+		if (ok) {
+			brick_index.resize(getBrickCount());
+			brick_distance.resize(getBrickCount());
+			brick_direction.resize(getBrickCount());
+			samples.resize((size_t)allocated * kSamplesPerBrick);
+			ok = fread(brick_index.data(), sizeof(int32_t), brick_index.size(), file) == brick_index.size() &&
+				fread(brick_distance.data(), sizeof(float), brick_distance.size(), file) == brick_distance.size() &&
+				fread(brick_direction.data(), sizeof(Point3), brick_direction.size(), file) == brick_direction.size() &&
+				fread(samples.data(), sizeof(float), samples.size(), file) == samples.size();
+		}
+		fclose(file);
+		return ok;
+	}
+
+	void save(const std::string &path, uint64_t hash) const {
+		FILE *file = fopen(path.c_str(), "wb");
+		if (file == NULL) {
+			std::cerr << "Failed to write SDF cache: " << path << std::endl;
+			return;
+		}
+		uint32_t magic = kCacheMagic;
+		int32_t allocated = getAllocatedBrickCount();
+		fwrite(&magic, sizeof(magic), 1, file);
+		fwrite(&hash, sizeof(hash), 1, file);
+		fwrite(&origin.x, sizeof(float), 3, file);
+		fwrite(&cell_size, sizeof(cell_size), 1, file);
+		fwrite(bricks, sizeof(int), 3, file);
+		fwrite(&allocated, sizeof(allocated), 1, file);
+		fwrite(brick_index.data(), sizeof(int32_t), brick_index.size(), file);
+		fwrite(brick_distance.data(), sizeof(float), brick_distance.size(), file);
+		fwrite(brick_direction.data(), sizeof(Point3), brick_direction.size(), file);
+		fwrite(samples.data(), sizeof(float), samples.size(), file);
+		fclose(file);
+	}
+};
+
+#endif
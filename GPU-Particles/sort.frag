@@ -0,0 +1,16 @@
+// Fragment shader for reordering particles.
+// Gathers each texel's state from the texel the permutation points at.
+
+uniform sampler2D positions;
+uniform sampler2D velocities;
+uniform sampler2D normals;
+uniform sampler2D permutation;
+
+void main()
+{
+	vec2 source = texture2D(permutation, gl_TexCoord[0].st).xy;
+
+	gl_FragData[0] = texture2D(positions, source);
+	gl_FragData[1] = texture2D(velocities, source);
+	gl_FragData[2] = texture2D(normals, source);
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+#ifndef _SPSC_QUEUE_
+#define _SPSC_QUEUE_
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * A bounded lock-free queue between exactly one producing thread and
+ * one consuming thread. Pushing to a full queue fails rather than blocks.
+ */
+template <typename T, size_t N>
+class SingleProducerQueue
+{
+public:
+	SingleProducerQueue() : head(0), tail(0) {}
+
+	bool push(const T &value) {
+		size_t current = tail.load(std::memory_order_relaxed);
+		size_t next = (current + 1) % N;
+		if (next == head.load(std::memory_order_acquire)) {
+			return false;
+		}
+		items[current] = value;
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &value) {
+		size_t current = head.load(std::memory_order_relaxed);
+		if (current == tail.load(std::memory_order_acquire)) {
+			return false;
+		}
+		value = items[current];
+		head.store((current + 1) % N, std::memory_order_release);
+		return true;
+	}
+
+private:
+	T items[N];
+
+	// Next item to pop, only written by the consumer.
+	std::atomic<size_t> head;
+	// Next slot to push, only written by the producer.
+	std::atomic<size_t> tail;
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,311 @@
+#ifndef _STEP_CONTROLLER_
+#define _STEP_CONTROLLER_
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "Utility\gl.hpp"
+#include "gl_state.hpp"
+
+// Must match the integrator branches in update.frag.
+enum Integrator
+{
+	SEMI_IMPLICIT_EULER = 0,
+	VELOCITY_VERLET,
+	RK2,
+	INTEGRATOR_COUNT,
+};
+
+inline const char *getIntegratorName(Integrator integrator) {
+	static const char *kNames[INTEGRATOR_COUNT] = { "euler", "verlet", "rk2" };
+	return kNames[integrator];
+}
+
+/**
+ * Reduces one channel of a texture to its maximum, 4x4 texels at a time
+ * through a chain of ever smaller textures. The 1x1 result is read back
+ * through alternating PBOs a frame late, so reading never stalls.
+ */
+class MaxReduction
+{
+public:
+	static const int kPBOCount = 2;
+
+	void create(GLuint width, GLuint height) {
+		shader.program = glLoadShader("reduce.vert", "reduce.frag");
+		source_uniform = glGetUniform(shader, "source");
+		source_size_uniform = glGetUniform(shader, "source_size");
+		channel_uniform = glGetUniform(shader, "channel");
+		glUseShader(shader);
+		glUniform1i(source_uniform, 1);
+		GL_CHECK();
+
+		while (width > 1 || height > 1) {
+			width = (width + 3) / 4;
+			height = (height + 3) / 4;
+
+			Level level;
+			level.width = width;
+			level.height = height;
+
+			glGenTextures(1, &level.texture);
+			glBindTexture(GL_TEXTURE_2D, level.texture);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT, 0);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+			glGenFramebuffers(1, &level.framebuffer);
+			glBindFramebuffer(GL_FRAMEBUFFER, level.framebuffer);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, level.texture, 0);
+			GL_CHECK();
+
+			levels.push_back(level);
+		}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		glGenBuffers(kPBOCount, pbos);
+		for (int i = 0; i < kPBOCount; ++i) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(GLfloat), 0, GL_STREAM_READ);
+			pending[i] = false;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		next_pbo = 0;
+		GL_CHECK();
+	}
+
+	void destroy() {
+		for (Level &level : levels) {
+			glDeleteFramebuffers(1, &level.framebuffer);
+			glDeleteTextures(1, &level.texture);
+		}
+		levels.clear();
+		glDeleteBuffers(kPBOCount, pbos);
+		glDeleteProgram(shader.program);
+	}
+
+	/**
+	 * Reduces the channel of |source| selected by the mask |channel| and
+	 * starts reading the result back, remembering |tag| alongside it.
+	 */
+	void reduce(GLState &gl_state, Texture source, GLuint width, GLuint height,
+		const GLfloat channel[4], float tag) {
+		gl_state.useProgram(shader.program);
+		gl_state.disable(GL_BLEND);
+
+		for (size_t i = 0; i < levels.size(); ++i) {
+			gl_state.bindFramebuffer(levels[i].framebuffer);
+			gl_state.viewport(0, 0, levels[i].width, levels[i].height);
+			gl_state.bindTexture(1, i == 0 ? source : levels[i - 1].texture);
+
+			glUniform2f(source_size_uniform, (GLfloat)width, (GLfloat)height);
+			if (i == 0) {
+				glUniform4fv(channel_uniform, 1, channel);
+			} else if (i == 1) {
+				glUniform4f(channel_uniform, 1.0f, 0.0f, 0.0f, 0.0f);
+			}
+
+			// glDrawTexturedQuad() binds its texture to the active unit, keep it off the sampler.
+			gl_state.activeTexture(0);
+			glDrawTexturedQuad(source);
+			gl_state.invalidateTexture(0);
+
+			width = levels[i].width;
+			height = levels[i].height;
+		}
+		GL_CHECK();
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next_pbo]);
+		glReadPixels(0, 0, 1, 1, GL_RED, GL_FLOAT, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		pending[next_pbo] = true;
+		tags[next_pbo] = tag;
+		next_pbo = (next_pbo + 1) % kPBOCount;
+		GL_CHECK();
+	}
+
+	/**
+	 * Takes the oldest result still in flight, returning false if there
+	 * is none. Must be called before each reduce() for it to free up.
+	 */
+	bool read(float &value, float &tag) {
+		if (!pending[next_pbo]) {
+			return false;
+		}
+		pending[next_pbo] = false;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbos[next_pbo]);
+		const GLfloat *result = (const GLfloat *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if (result != NULL) {
+			value = *result;
+			tag = tags[next_pbo];
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		GL_CHECK();
+		return result != NULL;
+	}
+
+private:
+	struct Level
+	{
+		GLuint width = 0;
+		GLuint height = 0;
+		Texture texture = 0;
+		GLuint framebuffer = 0;
+	};
+
+	Shader shader;
+	Uniform source_uniform = -1;
+	Uniform source_size_uniform = -1;
+	Uniform channel_uniform = -1;
+
+	std::vector<Level> levels;
+
+	GLuint pbos[kPBOCount];
+	bool pending[kPBOCount] = { false, false };
+	float tags[kPBOCount] = { 0.0f, 0.0f };
+	int next_pbo = 0;
+};
+
+/**
+ * Chooses how many update passes advance the simulation each frame.
+ *
+ * Steps are measured in reference steps, the 1/60 s the original fixed
+ * step took. Without a tolerance every step is at most the max step, and
+ * a max step longer than a frame spans several frames, the frames in
+ * between run no pass at all. With one, the step follows the largest local error estimate of the
+ * previous frame the way an ODE step size controller does, scaled by
+ * (tolerance / error)^(1 / (order + 1)).
+ *
+ * Passes per simulated second are counted for the benchmark; the
+ * original fixed step took 60.
+ */
+class StepController
+{
+public:
+	static const int kMaxPasses = 8;
+
+	void setIntegrator(Integrator new_integrator) {
+		integrator = new_integrator;
+	}
+
+	Integrator getIntegrator() const {
+		return integrator;
+	}
+
+	void setTolerance(float new_tolerance) {
+		tolerance = new_tolerance;
+	}
+
+	float getTolerance() const {
+		return tolerance;
+	}
+
+	/**
+	 * The step taken without a tolerance, in reference steps.
+	 */
+	void setMaxStep(float step) {
+		max_step = step;
+	}
+
+	/**
+	 * Feeds the largest error estimate of a frame whose steps were |step| long.
+	 */
+	void observe(float error, float step) {
+		// Limits on how fast the step may change from one frame to the next.
+		static const float kMinGrowth = 0.2f;
+		static const float kMaxGrowth = 4.0f;
+
+		largest_error = std::max(largest_error, error);
+		if (tolerance <= 0.0f) {
+			return;
+		}
+
+		// Local error is O(dt^2) for semi-implicit Euler, O(dt^3) for the others.
+		float exponent = integrator == SEMI_IMPLICIT_EULER ? 1.0f / 2.0f : 1.0f / 3.0f;
+		float scale = error > 0.0f ? 0.9f * pow(tolerance / error, exponent) : kMaxGrowth;
+		target_step = step * std::max(kMinGrowth, std::min(kMaxGrowth, scale));
+	}
+
+	/**
+	 * Returns the number of passes to advance by |frame_step| reference
+	 * steps and sets |step| to their length. Returns 0 while a step longer
+	 * than a frame is still owed less than its length.
+	 */
+	int plan(float frame_step, float &step) {
+		int passes;
+		if (tolerance <= 0.0f && max_step > frame_step) {
+			owed_steps += frame_step;
+			passes = owed_steps >= max_step * (1.0f - 1e-3f) ? 1 : 0;
+			step = max_step;
+			owed_steps = std::max(0.0f, owed_steps - passes * step);
+		} else {
+			step = max_step;
+			if (tolerance > 0.0f) {
+				// Never outgrow a frame, so an error spike only has a frame to shrink from.
+				target_step = std::min(target_step, frame_step);
+				step = target_step;
+			}
+			passes = (int)ceil(frame_step / step - 1e-3f);
+			if (passes > kMaxPasses) {
+				passes = kMaxPasses;
+			}
+			step = frame_step / passes;
+			owed_steps = 0.0f;
+		}
+		if (passes == 0) {
+			return 0;
+		}
+
+		total_passes += passes;
+		simulated_steps += passes * step;
+		smallest_step = std::min(smallest_step, step);
+		largest_step = std::max(largest_step, step);
+		return passes;
+	}
+
+	/**
+	 * Prints the passes per simulated second since the last report, with
+	 * |update_milliseconds| of GPU time per frame.
+	 */
+	void report(float update_milliseconds) {
+		if (simulated_steps <= 0.0f) {
+			return;
+		}
+		std::cout << "Integrator " << getIntegratorName(integrator)
+			<< (tolerance > 0.0f ? ", adaptive" : ", fixed")
+			<< ": " << (int)(total_passes * 60.0f / simulated_steps)
+			<< " update passes per simulated second (fixed step: 60)"
+			<< ", steps " << smallest_step << " to " << largest_step
+			<< ", max error " << largest_error
+			<< ", update " << update_milliseconds << " ms" << std::endl;
+
+		total_passes = 0;
+		simulated_steps = 0.0f;
+		smallest_step = 1e30f;
+		largest_step = 0.0f;
+		largest_error = 0.0f;
+	}
+
+private:
+	Integrator integrator = SEMI_IMPLICIT_EULER;
+	float tolerance = 0.0f;
+	float max_step = 1.0f;
+	float target_step = 1.0f;
+	// Simulated time a step longer than a frame has yet to catch up on.
+	float owed_steps = 0.0f;
+
+	int total_passes = 0;
+	float simulated_steps = 0.0f;
+	float smallest_step = 1e30f;
+	float largest_step = 0.0f;
+	float largest_error = 0.0f;
+};
+
+#endif
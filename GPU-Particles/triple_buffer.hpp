@@ -0,0 +1,63 @@
+#ifndef _TRIPLE_BUFFER_
+#define _TRIPLE_BUFFER_
+
+#include <atomic>
+
+/**
+ * Three buffers handed from a single writer to a single reader without
+ * locking, extending what FlipBuffer does for two sides. The writer fills
+ * the back buffer and publishes it by swapping it with the middle one; the
+ * reader swaps its front buffer with the middle one whenever something new
+ * has been published. Neither side ever waits for the other, and the reader
+ * always gets the newest complete buffer.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer() : middle(1) {}
+
+	T *getBackBuffer() {
+		return buffers + back;
+	}
+
+	/**
+	 * Makes the back buffer the newest one, the writer gets a new back buffer.
+	 */
+	void publish() {
+		back = middle.exchange(back | kFresh, std::memory_order_acq_rel) & kIndex;
+	}
+
+	/**
+	 * Takes the newest published buffer as the front buffer, returns
+	 * false if nothing has been published since the last acquire.
+	 */
+	bool acquire() {
+		if ((middle.load(std::memory_order_relaxed) & kFresh) == 0) {
+			return false;
+		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & kIndex;
+		return true;
+	}
+
+	T *getFrontBuffer() {
+		return buffers + front;
+	}
+
+	T *getBuffers() {
+		return buffers;
+	}
+
+private:
+	static const int kIndex = 3;
+	static const int kFresh = 4;
+
+	T buffers[3];
+
+	int back = 0;
+	// Index of the middle buffer, with kFresh set if it has not been acquired.
+	std::atomic<int> middle;
+	int front = 2;
+};
+
+#endif
\ No newline at end of file
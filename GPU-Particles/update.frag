@@ -1,5 +1,7 @@
 // Fragment shader for updating particle positions, velocities and lifetimes.
 
+#extension GL_ARB_uniform_buffer_object : enable
+
 float rand(vec2 co) {
     return fract(sin(dot(co.xy ,vec2(12.9898,78.233))) * 43758.5453);
 }
@@ -161,41 +163,153 @@ uniform sampler2D positions;
 uniform sampler2D velocities;
 uniform sampler2D normals;
 
-uniform vec2 mouse_position;
-uniform float mouse_down;
-
-uniform float curl_noise;
 uniform float curl_perturbance;
 
-uniform float lift;
-uniform float drag;
-uniform float decay;
-
-uniform float time;
+// Must match SimulationBlock in main.cpp.
+layout(std140) uniform SimulationBlock
+{
+	vec2 mouse_position;
+	float mouse_down;
+	float time; // simulated, in reference steps
+	float curl_noise;
+	float lift;
+	float drag;
+	float decay;
+	float noise_rate;
+	float dt; // in reference steps of 1/60 s
+	float integrator; // see Integrator in step_controller.hpp
+	float noise_phase; // first whole step due this pass, modulo noise_rate
+	float noise_steps; // whole steps due this pass
+};
+
+uniform sampler3D collider_bricks;
+uniform sampler3D collider_atlas;
+
+// Must match ColliderBlock in main.cpp.
+layout(std140) uniform ColliderBlock
+{
+	vec4 collider_origin[4]; // xyz origin, w cell size
+	vec4 collider_grid[4]; // xyz bricks, w first slice in collider_bricks
+	vec4 collider_bricks_size;
+	vec4 collider_atlas_size;
+	float collider_count;
+	float collider_radius;
+	float restitution;
+	float friction;
+};
 
 float PI = 3.1415926535897932384626433832795;
 
-void main()
+// Cells covered by each brick of a collider, see SignedDistanceField.
+const float kBrickCells = 7.0;
+
+// Each brick has two texels in collider_bricks, its entry then its direction.
+vec4 colliderBrick(int i, vec3 brick, float column)
 {
-	vec4 position = texture2D(positions, gl_TexCoord[0].st);
-	vec3 velocity = texture2D(velocities, gl_TexCoord[0].st).xyz;
-	vec3 normal = texture2D(normals, gl_TexCoord[0].st).xyz;
+	return texture3D(collider_bricks,
+		(vec3(brick.x * 2.0 + column, brick.y, brick.z + collider_grid[i].w) + 0.5) / collider_bricks_size.xyz);
+}
+
+float colliderDistance(int i, vec3 p)
+{
+	vec3 cell = (p - collider_origin[i].xyz) / collider_origin[i].w;
+	vec3 brick = floor(cell / kBrickCells);
+	if (any(lessThan(brick, vec3(0.0))) || any(greaterThanEqual(brick, collider_grid[i].xyz))) {
+		return 1e6;
+	}
+
+	vec4 entry = colliderBrick(i, brick, 0.0);
+	// Bricks away from the surface only store a distance bound.
+	if (entry.x < 0.0) {
+		return entry.w;
+	}
+
+	vec3 local = cell - brick * kBrickCells;
+	return texture3D(collider_atlas, (entry.xyz + local + 0.5) / collider_atlas_size.xyz).r;
+}
+
+// The outward normal at |p|, which must be inside the collider's grid.
+// Central differences only see a constant inside bricks away from the
+// surface and can cancel out elsewhere, so those fall back to the
+// outward direction stored with the brick.
+vec3 colliderNormal(int i, vec3 p)
+{
+	vec3 brick = floor((p - collider_origin[i].xyz) / collider_origin[i].w / kBrickCells);
+	vec3 direction = colliderBrick(i, brick, 1.0).xyz;
+	if (colliderBrick(i, brick, 0.0).x < 0.0) {
+		return direction;
+	}
+
+	float e = 0.5 * collider_origin[i].w;
+	vec3 gradient = vec3(
+		colliderDistance(i, p + vec3(e, 0.0, 0.0)) - colliderDistance(i, p - vec3(e, 0.0, 0.0)),
+		colliderDistance(i, p + vec3(0.0, e, 0.0)) - colliderDistance(i, p - vec3(0.0, e, 0.0)),
+		colliderDistance(i, p + vec3(0.0, 0.0, e)) - colliderDistance(i, p - vec3(0.0, 0.0, e)));
+	if (dot(gradient, gradient) > 1e-6 * e * e) {
+		return normalize(gradient);
+	}
+	return direction;
+}
+
+// x mod y for whole x >= 0 and y > 0. The quotient is kept half a step
+// away from whole numbers, which a GPU division may round either way.
+float wholeMod(float x, float y)
+{
+	return x - y * floor((x + 0.5) / y);
+}
+
+// How much of the curl noise this particle's band of 8 rows takes this
+// step. Bands take turns by reference step: a band is due at the whole
+// steps k where k + band is a multiple of noise_rate, and gets noise_rate
+// steps' worth of push each time. Counting the due steps in [time, time + dt)
+// keeps both the average push and which bands get it independent of the
+// step size. The host counts the whole steps in that range, so this only
+// ever works with small whole numbers and counts exactly. Whole bands keep
+// neighbouring fragments, and so whole warps, on the same branch.
+float noiseWeight()
+{
+	float band = floor(gl_FragCoord.y / 8.0);
+	// Whole steps into the pass until the band's first due step.
+	float due = wholeMod(noise_rate - wholeMod(noise_phase + band, noise_rate), noise_rate);
+	float count = max(0.0, floor((noise_steps - due - 0.5) / noise_rate) + 1.0);
+	return count * noise_rate / dt;
+}
+
+// Acceleration at |p|, per reference step squared.
+vec3 acceleration(vec3 p, float noise_weight)
+{
+	vec3 a = vec3(0.0, lift, 0.0);
 
 	if (mouse_down > 0.5) {
-		vec3 vecToMouse = position.xyz - vec3(mouse_position, 0.0);
+		vec3 vecToMouse = p - vec3(mouse_position, 0.0);
 		float vecToMouseDistance = length(vecToMouse);
 		vec3 normVecToMouse = normalize(vecToMouse);
-		velocity -= normVecToMouse * min(0.001, 1.0 / (vecToMouseDistance * vecToMouseDistance * vecToMouseDistance) / 1000);
-	} 
+		a -= normVecToMouse * min(0.001, 1.0 / (vecToMouseDistance * vecToMouseDistance * vecToMouseDistance) / 1000);
+	}
 
-	if (curl_noise > 0.5) {
-		velocity += curl(vec4(position.xyz * 3, time)).xyz / 1000;
+	if (noise_weight > 0.0) {
+		a += curl(vec4(p * 3, time)).xyz * noise_weight / 1000;
 	}
 
-	velocity += vec3(0.0, lift, 0.0);
-	velocity *= drag;
+	return a;
+}
+
+void main()
+{
+	vec4 position = texture2D(positions, gl_TexCoord[0].st);
+	vec3 velocity = texture2D(velocities, gl_TexCoord[0].st).xyz;
+	vec4 normal = texture2D(normals, gl_TexCoord[0].st); // w is the particle id
+
+	// drag is the velocity kept per reference step.
+	float damping = pow(drag, dt);
 
-	position.w -= decay;
+	float noise_weight = curl_noise > 0.5 ? noiseWeight() : 0.0;
+
+	// Estimated local position error of this step, reduced to its maximum
+	// across all particles to choose the next step size.
+	float error = 0.0;
+
+	position.w -= decay * dt;
 	// Reset if 0 life
 	if (position.w < 0) {
 		position.w = rand(position.xy);
@@ -210,10 +324,53 @@ void main()
 		velocity.x = radius * sqrt(1 - pow(z, 2)) * cos(theta);
 		velocity.y = radius * sqrt(1 - pow(z, 2)) * sin(theta);
 		velocity.z = radius * z;
+
+		position.xyz += velocity * dt;
+	} else if (integrator < 0.5) {
+		// Semi-implicit Euler, with dt = 1 this is the original fixed step.
+		vec3 a = acceleration(position.xyz, noise_weight);
+		velocity = (velocity + a * dt) * damping;
+		position.xyz += velocity * dt;
+		error = 0.5 * length(a) * dt * dt;
+	} else if (integrator < 1.5) {
+		// Velocity Verlet.
+		vec3 a0 = acceleration(position.xyz, noise_weight);
+		position.xyz += velocity * dt + 0.5 * a0 * dt * dt;
+		vec3 a1 = acceleration(position.xyz, noise_weight);
+		velocity = (velocity + 0.5 * (a0 + a1) * dt) * damping;
+		error = length(a1 - a0) * dt * dt / 6.0;
+	} else {
+		// RK2, midpoint.
+		vec3 a0 = acceleration(position.xyz, noise_weight);
+		vec3 mid_position = position.xyz + velocity * 0.5 * dt;
+		vec3 mid_velocity = (velocity + a0 * 0.5 * dt) * pow(drag, 0.5 * dt);
+		vec3 a1 = acceleration(mid_position, noise_weight);
+		position.xyz += mid_velocity * dt;
+		velocity = (velocity + a1 * dt) * damping;
+		error = 0.5 * length(a1 - a0) * dt * dt;
+	}
+
+	// Push particles out of colliders and reflect their velocity,
+	// mirrored by SignedDistanceField::collide().
+	for (int i = 0; i < 4; ++i) {
+		if (float(i) >= collider_count) {
+			break;
+		}
+		float distance = colliderDistance(i, position.xyz);
+		if (distance < collider_radius) {
+			vec3 collider_normal = colliderNormal(i, position.xyz);
+			position.xyz += collider_normal * (collider_radius - distance);
+
+			float normal_speed = dot(velocity, collider_normal);
+			if (normal_speed < 0.0) {
+				vec3 tangent = velocity - collider_normal * normal_speed;
+				velocity = tangent * (1.0 - friction) - collider_normal * (restitution * normal_speed);
+			}
+		}
 	}
 
 	// Update textures
-	gl_FragData[0] = position + vec4(velocity, 0.0);
-	gl_FragData[1] = vec4(velocity, 0.0);
-	gl_FragData[2] = vec4(normal, 0.0);
+	gl_FragData[0] = position;
+	gl_FragData[1] = vec4(velocity, error);
+	gl_FragData[2] = normal;
 }
\ No newline at end of file